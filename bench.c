@@ -0,0 +1,112 @@
+/*
+ * Quecto microbenchmarks - built by 'make bench', never installed
+ *
+ * Runs headless scenarios against the row API and the render path on a
+ * generated file and prints one tab-separated line per scenario:
+ *
+ *   scenario  ops  ns/op  MB/s
+ *
+ * Usage: quecto-bench [MB] [dir]   (default 64 MB in $TMPDIR or /tmp)
+ */
+
+#define Q_BENCH
+#include "quecto.c"
+
+#define BENCH_LINE "%08d the quick brown fox jumps over the lazy dog, again and again\n"
+
+double benchT0;
+double benchBytes; /* text in the buffer */
+
+void benchStart() { benchT0 = editorNow(); }
+
+/* Report 'ops' operations over 'bytes' since benchStart(). */
+void benchReport(const char *name, long ops, double bytes) {
+  double secs = editorNow() - benchT0;
+  if (secs < 1e-9) secs = 1e-9;
+  printf("%s\t%ld\t%.1f\t%.1f\n", name, ops, secs * 1e9 / ops, bytes / 1048576.0 / secs);
+  fflush(stdout);
+}
+
+/* Fill 'path' with numbered lines up to 'mb' megabytes. */
+size_t benchGenerate(const char *path, int mb) {
+  FILE *f = fopen(path, "w");
+  if (!f) { perror(path); exit(1); }
+  size_t total = 0, want = (size_t)mb << 20;
+  int i;
+  for (i = 0; total < want; i++) total += fprintf(f, BENCH_LINE, i);
+  fclose(f);
+  return total;
+}
+
+void benchInsert(const char *name, int where, long ops) {
+  char line[128];
+  long i;
+  int len = snprintf(line, sizeof(line), BENCH_LINE, 0) - 1;
+  benchStart();
+  for (i = 0; i < ops; i++) {
+    int at = where == 0 ? 0 : where == 1 ? E.numrows / 2 : E.numrows;
+    editorInsertRow(at, line, len);
+  }
+  benchBytes += (double)ops * (len + 1);
+  benchReport(name, ops, (double)ops * (len + 1));
+}
+
+/* Draw full frames at successive offsets with nothing carried over. */
+void benchRender(long ops) {
+  int out = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY), y;
+  long i;
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+  benchStart();
+  for (i = 0; i < ops; i++) {
+    E.rowoff = (int)((i * E.screenrows) % (E.numrows ? E.numrows : 1));
+    E.cy = E.rowoff; E.cx = 0;
+    for (y = 0; y < E.framerows; y++) editorFrameInvalidate(y);
+    editorRefreshScreen();
+  }
+  double bytes = (double)ops * (E.screenrows + 1) * E.screencols;
+  dup2(out, STDOUT_FILENO);
+  close(out); close(null);
+  benchReport("render", ops, bytes);
+}
+
+int main(int argc, char *argv[]) {
+  int mb = argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 64;
+  const char *dir = argc > 2 ? argv[2] : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/quecto-bench.%d", dir, (int)getpid());
+  editorInit();
+  E.screenrows = 48; E.screencols = 160;
+  E.wrapw = 0; editorLayout();
+  size_t size = benchGenerate(path, mb);
+
+  printf("scenario\tops\tns/op\tMB/s\n");
+  benchStart();
+  editorOpen(path);
+  editorIndexTo(INT_MAX);
+  benchReport("load", 1, size);
+  benchBytes = size;
+
+  benchInsert("insert_top", 0, 100000);
+  benchInsert("insert_middle", 1, 100000);
+  benchInsert("insert_end", 2, 100000);
+
+  benchStart();
+  editorRegexReplace("fox", "cat", 1, 1, 0, 0);
+  benchReport("replace_global", E.numrows, benchBytes);
+  benchStart();
+  editorRegexReplace("cat", "fox", 1, 1, 0, 1);
+  benchReport("replace_literal", E.numrows, benchBytes);
+
+  benchRender(20000);
+
+  benchStart();
+  editorSave();
+  editorSaveFinish(1);
+  struct stat st;
+  benchReport("save", 1, stat(path, &st) == 0 ? (double)st.st_size : 0);
+  if (strcmp(E.statusmsg, "Saved") != 0) fprintf(stderr, "save: %s\n", E.statusmsg);
+
+  unlink(path);
+  return 0;
+}
@@ -20,47 +20,347 @@
 #include <regex.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <setjmp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define Q_VERSION "1.2"
+#define Q_MMAP_MIN (8 << 20)  /* files at least this big are mapped and indexed lazily */
+#define Q_SCAN_SLICE (16 << 20) /* bytes of a mapped file line-counted per idle step */
+#define Q_CHECKPOINT 65536    /* lines per checkpoint of the line index, and per lazy chunk */
+#define Q_EXPAND 2048         /* lines of a lazy chunk split into rows around one looked up */
+#define Q_FOLLOW_SLICE (16 << 20) /* bytes of a followed file read per idle step */
+#define Q_DEPTH_SLICE (16 << 20) /* bytes scanned for brackets per idle step */
+#define Q_INDEX_CACHE 64      /* line indexes kept in the cache; the least recently used go */
+#define Q_SEARCH_SLICE 16384  /* rows the search index covers per idle step */
+#define Q_SEARCH_MAX (1 << 22) /* matches past which the search index is dropped */
+#define Q_SAVE_IOV 1024       /* row pieces per writev */
+#define Q_COPY_MIN (1 << 20)  /* unmodified mapped runs at least this big are copied in-kernel */
+#define Q_INBUF 65536         /* input ring size, a power of two */
+#define Q_ESC_MS 25           /* wait for the rest of an escape sequence */
+#define Q_TABSTOP 8           /* columns between tab stops */
+#ifndef Q_UNDO_MAX
+#define Q_UNDO_MAX (64 << 20) /* default bound on the undo log, in bytes */
+#endif
+#define Q_JOURNAL_BUF 65536   /* journal bytes buffered before a write */
+#define Q_JOURNAL_SYNC 1.0    /* seconds between fdatasyncs of the journal */
+#ifndef Q_FPS
+#define Q_MSG_SECS 5.0       /* seconds the load report stays on the status line */
+#define Q_FPS 120             /* default frame rate cap; 0 draws as soon as input is drained */
+#endif
 
 enum {
   BACKSPACE = 127,
   ARROW_LEFT = 1000, ARROW_RIGHT, ARROW_UP, ARROW_DOWN,
-  DEL_KEY, HOME_KEY, END_KEY, PAGE_UP, PAGE_DOWN
+  DEL_KEY, HOME_KEY, END_KEY, PAGE_UP, PAGE_DOWN, PASTE_START, PASTE_END
 };
 
+enum { UNDO_SPLICE, UNDO_ROWINS, UNDO_ROWDEL }; /* undo log operations */
+
+typedef struct smatch { int row, col; } smatch;
+
+/* How a row shows on screen when that isn't simply one column per byte
+ * (tabs, control bytes, UTF-8), laid out at one wrap width: the bytes to
+ * send, where each screen line starts in them, and the place (line * w +
+ * column) of the character holding each byte of the row. */
+typedef struct erender {
+  int w, len;
+  int *col;   /* [size + 1] */
+  int *line;  /* [h + 1] */
+  char *b;
+} erender;
+#define RENDER_STALE ((erender *)1) /* the row needs one, not built yet */
+
 typedef struct erow {
   int size;
+  int cap;     /* arena capacity; 0 = view into the file, read-only and not NUL-terminated */
+  int h;       /* screen lines the row wraps to at E.wrapw */
+  unsigned epoch; /* E.epoch when chars was allocated */
   char *chars;
+  erender *render; /* NULL if the row is plain ASCII and shows as it is */
 } erow;
 
+/* Rows live in a rope: an implicit treap of fixed-size row chunks, ordered
+ * by position and counted per subtree, so finding, inserting or deleting a
+ * line is O(log n) wherever it sits in the file. Subtrees also sum their
+ * wrapped heights, which turns "which row is on screen line v" into a
+ * descent too. Chunks are aligned to their size so a row finds its chunk
+ * from its own address. */
+#define ROPE_NODE_BYTES 8192
+#define ROW_NODE(row) ((rnode *)((uintptr_t)(row) & ~(uintptr_t)(ROPE_NODE_BYTES - 1)))
+
+typedef struct rnode {
+  struct rnode *l, *r, *p;
+  unsigned prio;
+  int n, cnt;   /* rows in this chunk / in this subtree */
+  int nvis, vis; /* screen lines in this chunk / in this subtree */
+  int lazy;     /* lines of the map this chunk stands for but hasn't split into rows */
+  char *lp;     /* ...and where they are */
+  size_t llen;
+  int sd, smin, sbmin; /* bracket depth in this chunk: net change, lowest after a bracket, lowest at a line end */
+  int td, tmin, tbmin; /* ...and the same over the subtree */
+  int stale, tstale;   /* the chunk needs rescanning / stale chunks in the subtree */
+  erow rows[];
+} rnode;
+
+#define DEPTH_NONE (INT_MAX / 4) /* "lowest depth" of a stretch with no bracket (or no line end) */
+
+#define ROPE_CHUNK ((int)((ROPE_NODE_BYTES - sizeof(rnode)) / sizeof(erow)))
+
+/* A lazy chunk is a small node holding no rows, only a run of whole lines
+ * of the mapping; it counts them as lines and as one screen line each. It is
+ * split into real chunks around a row when it is looked up (ropeExpandAt). */
+
+/* Subtrees also combine the bracket depth of their chunks, so the first or
+ * last spot past some point where the depth falls to a given level is found
+ * by descent (see Structure index). A changed chunk is only marked stale;
+ * idle time rescans it. */
+
+/* Row text comes from power-of-two size classes carved out of big arena
+ * blocks. Freed text goes back on its class's free list, so typing doubles
+ * a row's capacity now and then instead of realloc'ing on every key. */
+#define ARENA_BLOCK (1 << 20)
+#define ARENA_MIN 16
+#define ARENA_CLASSES 27  /* 16 B .. 1 GB */
+
+struct rowArena {
+  char *cur, *end;
+  char *free[ARENA_CLASSES]; /* freed blocks, linked through their first bytes */
+} A;
+
+/* The fields up to screenrows describe the current buffer and are swapped
+ * as a block when switching buffers; the rest is the editor's own. */
 struct editorConfig {
   int cx, cy;
   int rowoff;
-  int screenrows, screencols;
+  int wrapw;                    /* soft wrap width the row heights are for */
   int numrows;
-  erow *row;
+  rnode *rope;
+  rnode *rcache; /* last chunk looked up, for sequential access */
+  int rcache_at;
   int dirty;
-  int quit_times;
   char *filename;
+  char *loadbuf;      /* whole file read by the bulk loader; rows are views into it */
+  char *map;          /* read-only mapping of a large file */
+  int mapfd;          /* the mapped file, kept open for copy_file_range */
+  size_t mapsize, mapscan; /* bytes mapped / already split into rows */
+  int backing;        /* shared file contents the views point into, or -1 */
+  int mapck;          /* checkpoints of the map already in the rope */
+  int mapgen;         /* shrinks of the mapped file the rows are fixed up for */
+  off_t fpos;         /* bytes of the file the rows hold, as of the open or last save */
+  int fpart;          /* the last row is a line the file hasn't ended yet */
+  int fwd;            /* inotify watch while following the file, or -1 */
+  int fpend;          /* follow: 1 the file may have grown, 2 it may have been replaced */
+  char **fblk;        /* blocks of followed bytes that rows are views into */
+  int nfblk;
+  int markrow, markcol; /* corner of the block set with Ctrl+B (the cursor is the other), or -1 */
+  unsigned gen;                 /* bumped on every change to the text */
+  char *spat;                   /* last search pattern */
+  smatch *sidx;                 /* every match of spat, in order, built while idle */
+  int nsidx, sidxcap;
+  int sbuild;                   /* next row for the index builder; -1 idle, -2 given up */
+  int sready;                   /* sidx covers the whole buffer as of sgen */
+  unsigned sgen;
+  int scur;                     /* sidx entry the cursor was last moved to */
+  struct saveJob *save;         /* background save in flight, or NULL */
+  unsigned epoch;               /* bumped per save snapshot; older row text may be in it */
+  int screenrows, screencols;   /* first field shared by all buffers */
+  volatile sig_atomic_t resized;
+  int quit_times;
   char statusmsg[80];
+  double msgtime;               /* when statusmsg (a load report) goes, or 0 to keep it */
+  int prompting;                /* the prompt owns the bottom line; don't redraw */
+  int headless;                 /* running -c commands without a terminal */
+  int readonly;                 /* -R: refuse changes; nothing is ever dirty */
+  int journal;                  /* -j: journal every buffer */
+  int errors;                   /* failures reported while headless; the exit status */
+  int inofd;                    /* inotify instance for followed files, or -1 */
+  int redraw;                   /* state changed since the last frame */
+  int fps;                      /* frame rate cap, 0 for none */
+  double lastframe;             /* when the last frame was drawn */
+  unsigned long drawn, skipped; /* frames drawn / changes folded into a later frame */
+  char *scratch;                /* reusable buffer for rebuilding rows */
+  size_t scratchcap;
+  struct sline *frame, *shadow; /* screen being composed / as last drawn */
+  int framerows, framecols;
+  int shadowoff;                /* rowoff of the shadow frame */
   struct termios orig_termios;
 } E;
 
+void editorRefreshScreen();
+void editorScroll();
+void editorScheduleFrame();
+void editorFrame(int force);
+int editorFrameWait();
+void editorHandleResize();
+void editorFrameInvalidate(int y);
+void editorMapScan(size_t bytes);
+rnode *ropeExpand(rnode *n);
+void ropeExpandAt(rnode *n, int k);
+void backingDetach(struct stat *st);
+int editorMapCheck();
+void editorIndexTo(int rows);
+char *editorPrompt(char *prompt);
+int editorIdle();
+char *bufGrow(char **b, size_t *cap, size_t n);
+void editorExit();
+void editorFollowEvents();
+void editorFollowStop();
+int editorFollowWatch();
+void undoRecord(int type, int row, int col, const char *d, int dlen, const char *ins, int ilen);
+void journalRecord(int type, int row, int col, const char *d, int dlen, const char *ins, int ilen);
+double editorNow();
+int editorHasSpecial(const char *s, int n);
+int editorRowCol(erow *row, int at);
+erender *editorRowRender(erow *row);
+void editorRenderFree(erow *row);
+
+/* --- Instrumentation --- */
+
+/* Built with -DQ_STATS, the main loop times its read, process, render and
+ * write stages and counts allocations; the 'stats' command shows p50/p99.
+ * Otherwise the hooks compile to nothing. */
+#ifdef Q_STATS
+#define Q_STATS_SAMPLES 4096 /* latest samples kept per stage */
+enum { ST_READ, ST_PROCESS, ST_RENDER, ST_WRITE, ST_STAGES };
+
+struct qstats {
+  float us[ST_STAGES][Q_STATS_SAMPLES]; /* a ring of microsecond samples per stage */
+  unsigned long n[ST_STAGES];
+  unsigned long frames, bytes, allocs;
+  double keyat; /* when the key being processed was decoded */
+} S;
+
+void statAdd(int st, double since) { S.us[st][S.n[st]++ % Q_STATS_SAMPLES] = (editorNow() - since) * 1e6; }
+
+int statCmp(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+void statPercentiles(int st, float *p50, float *p99) {
+  static float v[Q_STATS_SAMPLES];
+  unsigned n = S.n[st] < Q_STATS_SAMPLES ? S.n[st] : Q_STATS_SAMPLES;
+  *p50 = *p99 = 0;
+  if (!n) return;
+  memcpy(v, S.us[st], n * sizeof(float));
+  qsort(v, n, sizeof(float), statCmp);
+  *p50 = v[n / 2]; *p99 = v[n * 99 / 100];
+}
+
+void statShow() {
+  float p[ST_STAGES][2];
+  int i;
+  for (i = 0; i < ST_STAGES; i++) statPercentiles(i, &p[i][0], &p[i][1]);
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "us p50/p99 rd %.0f/%.0f key %.0f/%.0f draw %.0f/%.0f wr %.0f/%.0f %luB/f %lu alloc",
+           p[ST_READ][0], p[ST_READ][1], p[ST_PROCESS][0], p[ST_PROCESS][1], p[ST_RENDER][0], p[ST_RENDER][1],
+           p[ST_WRITE][0], p[ST_WRITE][1], S.frames ? S.bytes / S.frames : 0, S.allocs);
+}
+
+#define STAT_T0(v) double v = editorNow()
+#define STAT_ADD(st, v) statAdd(st, v)
+#define STAT_COUNT(f, k) (S.f += (k))
+#define STAT_MARK(f) (S.f = editorNow())
+#else
+#define STAT_T0(v)
+#define STAT_ADD(st, v)
+#define STAT_COUNT(f, k)
+#define STAT_MARK(f)
+#endif
+
+/* --startup-trace: the time each startup phase ended, printed to stderr on
+ * exit. Phases past the first paint (the background line count, the bracket
+ * index) are marked by the idle work that finishes them. */
+#define TRACE_MAX 16
+struct { const char *name[TRACE_MAX]; double at[TRACE_MAX]; int n; double t0; } T;
+
+void traceMark(const char *name) {
+  int i;
+  if (!T.t0 || T.n == TRACE_MAX) return;
+  for (i = 0; i < T.n; i++) if (T.name[i] == name) return; /* First time only */
+  T.name[T.n] = name; T.at[T.n++] = editorNow();
+}
+
+void tracePrint() {
+  int i;
+  for (i = 0; i < T.n; i++)
+    fprintf(stderr, "%-12s %9.3f ms %9.3f ms\n", T.name[i], (T.at[i] - (i ? T.at[i - 1] : T.t0)) * 1e3, (T.at[i] - T.t0) * 1e3);
+}
+
 /* --- Terminal & raw mode --- */
 
+/* Output for the terminal is composed in one buffer that lives as long as
+ * the editor, so a frame or a prompt costs no allocation once it has grown
+ * to fit, and goes out in one write. */
+struct abuf { char *b; size_t len, cap; } OUT;
+
+void abAppend(struct abuf *ab, const char *s, size_t len) {
+  if (ab->len + len > ab->cap) { STAT_COUNT(allocs, 1); bufGrow(&ab->b, &ab->cap, ab->len + len); }
+  memcpy(ab->b + ab->len, s, len);
+  ab->len += len;
+}
+
+/* Write all of s[0..n) to the terminal, however little a slow one takes at a time. */
+void termWrite(const char *s, size_t n) {
+  while (n) {
+    ssize_t w = write(STDOUT_FILENO, s, n);
+    if (w > 0) { s += w; n -= w; continue; }
+    if (w == -1 && errno == EINTR) continue;
+    if (w == -1 && errno == EAGAIN) { struct pollfd p = {STDOUT_FILENO, POLLOUT, 0}; poll(&p, 1, 100); continue; }
+    return; /* The terminal is gone */
+  }
+}
+
+void termFlush() {
+  termWrite(OUT.b, OUT.len);
+  OUT.len = 0;
+}
+
 void disableRawMode() {
+  static int done; /* Called by die() or exit, then by atexit */
+  if (done++) return;
+  termWrite("\x1b[?2004l", 8); /* Bracketed paste off */
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
 }
 
 void die(const char *s) {
   disableRawMode(); /* Restore TTY state to avoid staircase effect */
-  write(STDOUT_FILENO, "\x1b[0m\x1b[2J\x1b[H", 11);
+  termWrite("\x1b[0m\x1b[2J\x1b[H", 11);
   perror(s);
   exit(1);
 }
 
+/* Report a failure on the status line, or on stderr when headless. */
+void editorFail(const char *msg) {
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "%s", msg);
+  E.msgtime = 0;
+  if (!E.headless) return;
+  fprintf(stderr, "quecto: %s: %s\n", E.filename ? E.filename : "-", msg);
+  E.errors++;
+}
+
+/* Refuse a change under -R. */
+int editorReadOnly() {
+  if (E.readonly) editorFail("Read-only (-R)");
+  return E.readonly;
+}
+
 void enableRawMode() {
   if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
   atexit(disableRawMode);
@@ -70,47 +370,130 @@ void enableRawMode() {
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0; /* Never block in read; waiting is done with poll */
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  termWrite("\x1b[?2004h", 8); /* Bracketed paste on */
 }
 
-int editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-  if (c == '\x1b') {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
+/* Input bytes not yet decoded. Everything the terminal has sent is read in
+ * one go, so a burst of keys or a paste costs a few syscalls, not one per byte. */
+struct inputRing { unsigned char b[Q_INBUF]; unsigned r, w; } IN;
+
+/* Read whatever input is available, waiting up to 'ms' (-1 forever) for
+ * some to arrive. Returns the number of bytes added. */
+int editorInputFill(int ms) {
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {E.inofd, POLLIN, 0}};
+  double until = ms > 0 ? editorNow() + ms / 1e3 : 0;
+  int added = 0;
+  while (IN.w - IN.r < Q_INBUF) {
+    if (poll(pfd, E.inofd == -1 ? 1 : 2, added ? 0 : ms) <= 0) break;
+    if (pfd[1].revents) { /* A followed file changed; note it and keep waiting for keys */
+      editorFollowEvents();
+      if (!pfd[0].revents) {
+        if (added || !ms || (ms > 0 && (ms = (int)((until - editorNow()) * 1e3)) <= 0)) break;
+        continue;
       }
     }
+    unsigned at = IN.w & (Q_INBUF - 1), room = Q_INBUF - (IN.w - IN.r);
+    if (room > Q_INBUF - at) room = Q_INBUF - at;
+    STAT_T0(t);
+    ssize_t n = read(STDIN_FILENO, IN.b + at, room);
+    STAT_ADD(ST_READ, t);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (n <= 0) break;
+    IN.w += n; added += n;
+  }
+  return added;
+}
+
+int inputAt(unsigned i) { return IN.b[(IN.r + i) & (Q_INBUF - 1)]; }
+
+/* Decode one key from the ring. Returns -1 if the ring is empty or ends in
+ * an incomplete escape sequence; with 'flush' that is taken as a bare Esc. */
+int editorDecodeKey(int flush) {
+  unsigned n = IN.w - IN.r, i = 2;
+  if (n == 0) return -1;
+  int c = inputAt(0);
+  if (c != '\x1b') { IN.r++; return c; }
+  if (n >= 2 && inputAt(1) == 'O') { /* SS3, sent in application cursor mode */
+    if (n < 3) return flush ? (IN.r++, '\x1b') : -1;
+    int f = inputAt(2);
+    const char *k = f ? strchr("ABCDHF", f) : NULL;
+    if (k) {
+      static const int keys[] = {ARROW_UP, ARROW_DOWN, ARROW_RIGHT, ARROW_LEFT, HOME_KEY, END_KEY};
+      IN.r += 3;
+      return keys[k - "ABCDHF"];
+    }
+    IN.r++; /* Other SS3 keys (F1-F4, keypad): a bare Esc, as elsewhere */
     return '\x1b';
   }
+  if (n >= 2 && inputAt(1) == '[') { /* CSI: ESC [ params final */
+    int param = 0;
+    while (i < n && (isdigit(inputAt(i)) || inputAt(i) == ';')) {
+      if (isdigit(inputAt(i)) && param < 100000) param = param * 10 + inputAt(i) - '0';
+      i++;
+    }
+    if (i < n) {
+      int f = inputAt(i);
+      IN.r += i + 1;
+      switch (f) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        case '~':
+          switch (param) {
+            case 1: case 7: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: case 8: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 200: return PASTE_START;
+            case 201: return PASTE_END;
+          }
+      }
+      return '\x1b';
+    }
+  } else if (n >= 2) { IN.r++; return '\x1b'; }
+  if (!flush) return -1;
+  IN.r++;
+  return '\x1b';
+}
+
+/* Whether the keys read since *from include a bare Esc. They are only
+ * looked at and stay queued; *from moves past them. With 'flush' an
+ * incomplete sequence at the end counts as Esc, as in editorDecodeKey. */
+int editorInputEsc(unsigned *from, int flush) {
+  unsigned r = IN.r, at;
+  int c, esc = 0;
+  IN.r = *from;
+  while (!esc && (at = IN.r, c = editorDecodeKey(flush)) != -1) esc = c == '\x1b' && IN.r - at == 1;
+  *from = IN.r;
+  IN.r = r;
+  return esc;
+}
+
+/* Next key. Pending frames are drawn only once the input read so far is
+ * used up, so a burst of keys costs one frame; background work runs while
+ * no key is waiting. */
+int editorReadKey() {
+  int c;
+  while ((c = editorDecodeKey(0)) == -1) {
+    if (E.resized) { editorHandleResize(); editorScheduleFrame(); }
+    if (IN.w != IN.r) { /* Part of an escape sequence: wait briefly for the rest */
+      if (!editorInputFill(Q_ESC_MS)) c = editorDecodeKey(1);
+      if (c != -1) break;
+      continue;
+    }
+    if (editorInputFill(0)) continue;
+    editorFrame(0);
+    if (editorIdle()) continue;
+    int wait = editorFrameWait();
+    editorInputFill(wait >= 0 && wait < 100 ? wait : 100);
+  }
+  STAT_MARK(keyat);
   return c;
 }
 
@@ -122,303 +505,3065 @@ int getWindowSize(int *rows, int *cols) {
   return 0;
 }
 
+/* --- Row storage (rope) --- */
+
+unsigned ropeRand() {
+  static unsigned s = 2463534242u;
+  s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+  return s;
+}
+
+rnode *ropeNewNode() {
+  STAT_COUNT(allocs, 1);
+  rnode *n = aligned_alloc(ROPE_NODE_BYTES, ROPE_NODE_BYTES);
+  n->l = n->r = n->p = NULL;
+  n->prio = ropeRand();
+  n->n = n->cnt = 0;
+  n->nvis = n->vis = 0;
+  n->lazy = 0; n->lp = NULL; n->llen = 0;
+  n->sd = n->td = 0; n->smin = n->sbmin = n->tmin = n->tbmin = DEPTH_NONE;
+  n->stale = n->tstale = 1;
+  return n;
+}
+
+int depthMin(int a, int b) { return a < b ? a : b; }
+
+void ropePull(rnode *n) {
+  int ld = n->l ? n->l->td : 0, rd = ld + n->sd;
+  n->cnt = n->n + n->lazy + (n->l ? n->l->cnt : 0) + (n->r ? n->r->cnt : 0);
+  n->vis = n->nvis + (n->l ? n->l->vis : 0) + (n->r ? n->r->vis : 0);
+  n->td = rd + (n->r ? n->r->td : 0);
+  n->tmin = depthMin(depthMin(n->l ? n->l->tmin : DEPTH_NONE, ld + n->smin), n->r ? rd + n->r->tmin : DEPTH_NONE);
+  n->tbmin = depthMin(depthMin(n->l ? n->l->tbmin : DEPTH_NONE, ld + n->sbmin), n->r ? rd + n->r->tbmin : DEPTH_NONE);
+  n->tstale = n->stale + (n->l ? n->l->tstale : 0) + (n->r ? n->r->tstale : 0);
+}
+
+/* The chunk's text changed: its bracket depth needs rescanning. */
+void ropeTouch(rnode *n) {
+  if (n->stale) return;
+  n->stale = 1;
+  for (; n; n = n->p) n->tstale++;
+}
+
+int ropeChunkVis(rnode *n) {
+  int v = n->lazy, j;
+  for (j = 0; j < n->n; j++) v += n->rows[j].h;
+  return v;
+}
+
+void ropeFixUp(rnode *n) { for (; n; n = n->p) ropePull(n); }
+
+void ropeSetChild(rnode *p, rnode *old, rnode *n) {
+  if (!p) E.rope = n;
+  else if (p->l == old) p->l = n;
+  else p->r = n;
+  if (n) n->p = p;
+}
+
+/* Rotate n above its parent, keeping in-order position. */
+void ropeRotateUp(rnode *n) {
+  rnode *p = n->p;
+  ropeSetChild(p->p, p, n);
+  if (p->l == n) { p->l = n->r; if (p->l) p->l->p = p; n->r = p; }
+  else { p->r = n->l; if (p->r) p->r->p = p; n->l = p; }
+  p->p = n;
+  ropePull(p); ropePull(n);
+}
+
+rnode *ropeFirst() {
+  rnode *n = E.rope;
+  while (n && n->l) n = n->l;
+  return n;
+}
+
+rnode *ropeLast() {
+  rnode *n = E.rope;
+  while (n && n->r) n = n->r;
+  return n;
+}
+
+rnode *ropeNext(rnode *n) {
+  if (n->r) { n = n->r; while (n->l) n = n->l; return n; }
+  while (n->p && n->p->r == n) n = n->p;
+  return n->p;
+}
+
+/* Position of a row: its offset in the chunk plus the rows before the chunk. */
+int ropeIndexOf(erow *row) {
+  rnode *n = ROW_NODE(row);
+  int at = (row - n->rows) + (n->l ? n->l->cnt : 0);
+  for (; n->p; n = n->p)
+    if (n == n->p->r) at += (n->p->l ? n->p->l->cnt : 0) + n->p->n + n->p->lazy;
+  return at;
+}
+
+/* Find the chunk holding row 'at'; at == numrows yields the end of the last chunk. */
+rnode *ropeFind(int at, int *k) {
+  rnode *n = E.rope;
+  int from = at;
+  while (n) {
+    int lc = n->l ? n->l->cnt : 0, c = n->n + n->lazy;
+    if (at < lc) n = n->l;
+    else if (at < lc + c || (at == lc + c && !n->r)) {
+      if (n->lazy) { ropeExpandAt(n, at - lc); n = E.rope; at = from; continue; }
+      *k = at - lc; return n;
+    }
+    else { at -= lc + c; n = n->r; }
+  }
+  return NULL;
+}
+
+/* The lazy chunk holding row 'at', with its first row in *first; NULL if
+ * that row is real. Unlike ropeFind nothing is split. */
+rnode *ropeLazyAt(int at, int *first) {
+  rnode *n = E.rope;
+  int base = 0;
+  while (n) {
+    int lc = n->l ? n->l->cnt : 0, c = n->n + n->lazy;
+    if (at < lc) n = n->l;
+    else if (at < lc + c) { *first = base + lc; return n->lazy ? n : NULL; }
+    else { at -= lc + c; base += lc + c; n = n->r; }
+  }
+  return NULL;
+}
+
+void ropeInsertAfter(rnode *x, rnode *y) {
+  if (!x->r) { x->r = y; y->p = x; }
+  else { rnode *t = x->r; while (t->l) t = t->l; t->l = y; y->p = t; }
+  ropeFixUp(y);
+  while (y->p && y->prio > y->p->prio) ropeRotateUp(y);
+}
+
+void ropeRemove(rnode *n) {
+  while (n->l && n->r) ropeRotateUp(n->l->prio > n->r->prio ? n->l : n->r);
+  rnode *p = n->p;
+  ropeSetChild(p, n, n->l ? n->l : n->r);
+  ropeFixUp(p);
+  free(n);
+}
+
+/* Move the upper half of a full chunk into a new successor chunk. */
+rnode *ropeSplit(rnode *n) {
+  rnode *m = ropeNewNode();
+  int half = n->n / 2;
+  m->n = n->n - half;
+  memcpy(m->rows, &n->rows[half], sizeof(erow) * m->n);
+  n->n = half;
+  ropeTouch(n);
+  m->nvis = ropeChunkVis(m);
+  n->nvis -= m->nvis;
+  ropeInsertAfter(n, m);
+  return m;
+}
+
+/* Fold a sparse chunk into its successor so deletes don't leave the rope full of near-empty nodes. */
+void ropeMerge(rnode *n) {
+  rnode *s = ropeNext(n);
+  if (s && !s->lazy && n->n + s->n <= ROPE_CHUNK) {
+    memmove(&s->rows[n->n], s->rows, sizeof(erow) * s->n);
+    memcpy(s->rows, n->rows, sizeof(erow) * n->n);
+    s->n += n->n;
+    s->nvis += n->nvis;
+    ropeTouch(s);
+    n->n = 0;
+    n->nvis = 0;
+    ropeFixUp(s);
+  }
+  if (n->n == 0) ropeRemove(n); else ropeFixUp(n);
+}
+
+/* Screen line (counting from the top of the file) where row 'at' starts. */
+int editorVisualRow(int at) {
+  rnode *n = E.rope;
+  int v = 0;
+  while (n) {
+    int lc = n->l ? n->l->cnt : 0, lv = n->l ? n->l->vis : 0;
+    if (at < lc) { n = n->l; continue; }
+    if (at < lc + n->n + n->lazy) {
+      int j;
+      if (n->lazy) return v + lv + at - lc;
+      for (j = 0; j < at - lc; j++) v += n->rows[j].h;
+      return v + lv;
+    }
+    v += lv + n->nvis;
+    at -= lc + n->n + n->lazy;
+    n = n->r;
+  }
+  return v;
+}
+
+/* Row shown on screen line v, and which of its wrapped lines that is. */
+int editorRowAtVisual(int v, int *sub) {
+  rnode *n = E.rope;
+  int at = 0;
+  while (n) {
+    int lc = n->l ? n->l->cnt : 0, lv = n->l ? n->l->vis : 0;
+    if (v < lv) { n = n->l; continue; }
+    v -= lv; at += lc;
+    if (v < n->nvis) {
+      int j;
+      if (n->lazy) { *sub = 0; return at + v; }
+      for (j = 0; v >= n->rows[j].h; j++) v -= n->rows[j].h;
+      *sub = v;
+      return at + j;
+    }
+    v -= n->nvis; at += n->n + n->lazy;
+    n = n->r;
+  }
+  *sub = 0;
+  return E.numrows;
+}
+
+erow *editorRowAt(int at) {
+  if (E.rcache && at >= E.rcache_at && at < E.rcache_at + E.rcache->n)
+    return &E.rcache->rows[at - E.rcache_at];
+  int k;
+  rnode *n = ropeFind(at, &k);
+  E.rcache = n; E.rcache_at = at - k;
+  return &n->rows[k];
+}
+
+/* Append a row slot after chunk *tail (the last one, or a lazy chunk being
+ * expanded), which is kept across calls; ropeFixUp(*tail) once the batch is done. */
+erow *ropeAppend(rnode **tail) {
+  rnode *t = *tail;
+  if (!t || t->n == ROPE_CHUNK || t->lazy) {
+    rnode *m = ropeNewNode();
+    if (t) { ropeFixUp(t); ropeInsertAfter(t, m); } else E.rope = m;
+    *tail = t = m;
+  }
+  E.numrows++;
+  E.rcache = NULL;
+  ropeTouch(t);
+  erow *row = &t->rows[t->n++];
+  row->h = 0;
+  row->render = NULL;
+  return row;
+}
+
+/* Open a slot for a new row at 'at' and return it uninitialized. */
+erow *ropeInsert(int at) {
+  int k = 0;
+  rnode *n = E.rope ? ropeFind(at, &k) : NULL;
+  if (!n) n = E.rope = ropeNewNode();
+  else if (n->n == ROPE_CHUNK) {
+    rnode *m = ropeSplit(n);
+    if (k > n->n) { k -= n->n; n = m; }
+  }
+  memmove(&n->rows[k + 1], &n->rows[k], sizeof(erow) * (n->n - k));
+  n->n++;
+  ropeTouch(n);
+  ropeFixUp(n);
+  E.rcache = NULL;
+  E.numrows++;
+  n->rows[k].h = 0;
+  n->rows[k].render = NULL;
+  return &n->rows[k];
+}
+
+/* Drop a row's render and refresh its cached wrap height after its text changed. */
+void editorUpdateRow(erow *row) {
+  E.gen++;
+  ropeTouch(ROW_NODE(row));
+  editorRenderFree(row);
+  row->render = editorHasSpecial(row->chars, row->size) ? RENDER_STALE : NULL;
+  int h = editorRowCol(row, row->size) / E.wrapw + 1, d = h - row->h;
+  if (!d) return;
+  row->h = h;
+  rnode *n = ROW_NODE(row);
+  n->nvis += d;
+  for (; n; n = n->p) n->vis += d;
+}
+
+void ropeRepull(rnode *n) {
+  if (!n) return;
+  ropeRepull(n->l); ropeRepull(n->r);
+  ropePull(n);
+}
+
+/* Recompute every wrap height when the screen width changes. */
+void editorLayout() {
+  int w = E.screencols - 1 > 0 ? E.screencols - 1 : 1, j;
+  if (w == E.wrapw) return;
+  E.wrapw = w;
+  rnode *n;
+  for (n = ropeFirst(); n; n = ropeNext(n)) {
+    for (j = 0; j < n->n; j++) {
+      erow *row = &n->rows[j];
+      if (row->render) { editorRenderFree(row); row->render = RENDER_STALE; } /* Laid out for the old width */
+      row->h = editorRowCol(row, row->size) / w + 1;
+    }
+    n->nvis = ropeChunkVis(n);
+  }
+  ropeRepull(E.rope);
+}
+
+/* --- Row text arena --- */
+
+int arenaClass(size_t n) {
+  int c = 0;
+  while (((size_t)ARENA_MIN << c) < n) c++;
+  return c;
+}
+
+void arenaFree(char *p, int cap) {
+  if (cap > ARENA_BLOCK / 4) { free(p); return; } /* Big rows go straight to libc */
+  int c = arenaClass(cap);
+  *(char **)p = A.free[c];
+  A.free[c] = p;
+}
+
+/* Allocate at least n bytes; the class size is stored in *cap. */
+char *arenaAlloc(size_t n, int *cap) {
+  STAT_COUNT(allocs, 1);
+  int c = arenaClass(n);
+  size_t sz = (size_t)ARENA_MIN << c;
+  *cap = sz;
+  if (sz > ARENA_BLOCK / 4) return malloc(sz);
+  char *p = A.free[c];
+  if (p) { A.free[c] = *(char **)p; return p; }
+  if ((size_t)(A.end - A.cur) < sz) {
+    /* Hand the tail of the old block to the free lists, then start a new one */
+    while (A.end - A.cur >= ARENA_MIN) {
+      int t = 0;
+      while (((size_t)ARENA_MIN << (t + 1)) <= (size_t)(A.end - A.cur)) t++;
+      arenaFree(A.cur, ARENA_MIN << t);
+      A.cur += ARENA_MIN << t;
+    }
+    A.cur = malloc(ARENA_BLOCK);
+    A.end = A.cur + ARENA_BLOCK;
+  }
+  p = A.cur;
+  A.cur += sz;
+  return p;
+}
+
 /* --- Row operations --- */
 
+void editorSaveDefer(char *p, int cap);
+
+/* Row text a background save may still be reading: owned, and allocated
+ * before its snapshot was taken. It must be copied before any change. */
+int editorRowShared(erow *row) { return E.save && row->cap && row->epoch != E.epoch; }
+
+void editorRowRelease(erow *row) {
+  if (editorRowShared(row)) editorSaveDefer(row->chars, row->cap);
+  else if (row->cap) arenaFree(row->chars, row->cap);
+}
+
+/* Make sure the row owns at least 'need' bytes of text it may change,
+ * copying a view (or text a save is reading) before its first change. */
+void editorRowReserve(erow *row, size_t need) {
+  if ((size_t)row->cap >= need && !editorRowShared(row)) return;
+  int cap;
+  char *s = arenaAlloc(need, &cap);
+  memcpy(s, row->chars, row->size);
+  s[row->size] = '\0';
+  editorRowRelease(row);
+  row->chars = s;
+  row->cap = cap;
+  row->epoch = E.epoch;
+}
+
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.numrows++;
+  undoRecord(UNDO_ROWINS, at, 0, NULL, 0, s, len);
+  erow *row = ropeInsert(at);
+  row->size = len;
+  row->chars = arenaAlloc(len + 1, &row->cap);
+  row->epoch = E.epoch;
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  editorUpdateRow(row);
   E.dirty++;
 }
 
-void editorFreeRow(erow *row) { free(row->chars); }
+void editorFreeRow(erow *row) { editorRowRelease(row); editorRenderFree(row); }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  int k;
+  rnode *n = ropeFind(at, &k);
+  undoRecord(UNDO_ROWDEL, at, 0, n->rows[k].chars, n->rows[k].size, NULL, 0);
+  editorFreeRow(&n->rows[k]);
+  n->nvis -= n->rows[k].h;
+  memmove(&n->rows[k], &n->rows[k + 1], sizeof(erow) * (n->n - k - 1));
+  n->n--;
+  ropeTouch(n);
+  if (n->n < ROPE_CHUNK / 4) ropeMerge(n); else ropeFixUp(n);
+  E.rcache = NULL;
   E.numrows--;
+  E.gen++;
   E.dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
+  char ch = c;
+  undoRecord(UNDO_SPLICE, ropeIndexOf(row), at, NULL, 0, &ch, 1);
+  editorRowReserve(row, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
+  editorUpdateRow(row);
   E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  undoRecord(UNDO_SPLICE, ropeIndexOf(row), row->size, NULL, 0, s, len);
+  editorRowReserve(row, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
+  editorUpdateRow(row);
   E.dirty++;
 }
 
 void editorRowDelBytes(erow *row, int at, int len) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len);
+  undoRecord(UNDO_SPLICE, ropeIndexOf(row), at, row->chars + at, len, NULL, 0);
+  editorRowReserve(row, row->size + 1);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
   row->size -= len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Replace row[col..col + dlen) of row 'at' by ins[0..ilen): one undo
+ * record and at most one reallocation, however much moves. */
+void editorRowSplice(erow *row, int at, int col, int dlen, const char *ins, int ilen) {
+  undoRecord(UNDO_SPLICE, at, col, row->chars + col, dlen, ins, ilen);
+  editorRowReserve(row, row->size - dlen + ilen + 1);
+  memmove(row->chars + col + ilen, row->chars + col + dlen, row->size - col - dlen);
+  if (ilen) memcpy(row->chars + col, ins, ilen);
+  row->size += ilen - dlen;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
   E.dirty++;
 }
 
+/* Replace a row's text with s[0..len). */
+void editorRowSet(erow *row, const char *s, size_t len) {
+  int pre = 0, suf = 0, max = (size_t)row->size < len ? row->size : (int)len;
+  while (pre < max && row->chars[pre] == s[pre]) pre++;
+  while (suf < max - pre && row->chars[row->size - 1 - suf] == s[len - 1 - suf]) suf++;
+  undoRecord(UNDO_SPLICE, ropeIndexOf(row), pre, row->chars + pre, row->size - pre - suf, s + pre, len - pre - suf);
+  if ((size_t)row->cap < len + 1 || editorRowShared(row)) {
+    editorRowRelease(row);
+    row->chars = arenaAlloc(len + 1, &row->cap);
+    row->epoch = E.epoch;
+  }
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorUpdateRow(row);
+}
+
+/* --- Undo --- */
+
+/* Every change is logged as a compact operation in one append-only buffer:
+ * a splice (bytes deleted and inserted at a row and column) or a whole
+ * row inserted or deleted. A replace logs only the part of each row that
+ * changed, so nothing is ever copied wholesale. The log is [header, bytes,
+ * padding, total size] records; the trailing size lets undo walk back.
+ * Records from 'cur' on are the redo side. The first record of each step
+ * is flagged, and undo/redo apply records up to the next flag. */
+typedef struct uop { int type, start, row, col, dlen, ilen; } uop;
+
+struct undoLog {
+  char *b;
+  size_t len, cap, cur, limit;
+  int brk;       /* the next record starts a new step */
+  int applying;  /* undo/redo in progress: don't log */
+  int lost;      /* the current step outgrew the limit and is not kept */
+  size_t last;   /* offset of the last record, for merging typed characters */
+} U;
+
+size_t uopSize(const uop *o) { return (sizeof(uop) + o->dlen + o->ilen + 3) / 4 * 4 + 4; }
+
+/* Serialize a record at b[at]; returns its size. */
+size_t uopPut(char **b, size_t *cap, size_t at, const uop *o, const char *d, const char *ins) {
+  size_t sz = uopSize(o);
+  char *p = bufGrow(b, cap, at + sz) + at;
+  memcpy(p, o, sizeof(uop));
+  if (o->dlen) memcpy(p + sizeof(uop), d, o->dlen);
+  if (o->ilen) memcpy(p + sizeof(uop) + o->dlen, ins, o->ilen);
+  memset(p + sizeof(uop) + o->dlen + o->ilen, 0, sz - 4 - sizeof(uop) - o->dlen - o->ilen);
+  memcpy(p + sz - 4, &(uint32_t){sz}, 4);
+  return sz;
+}
+
+/* Let the next change start a new undo step. */
+void undoBreak() { U.brk = 1; }
+
+/* Drop the oldest steps until the log is back under half its limit, or
+ * just under the limit if the newest steps alone are bigger than half. */
+void undoTrim() {
+  size_t off = 0, keep = U.len;
+  uop o;
+  while (off < U.len) {
+    memcpy(&o, U.b + off, sizeof(uop));
+    if (o.start && U.len - off <= U.limit && keep == U.len) keep = off;
+    if (o.start && U.len - off <= U.limit / 2) { keep = off; break; }
+    off += uopSize(&o);
+  }
+  if (keep == U.len) { U.lost = 1; U.len = U.cur = 0; return; } /* The current step alone is bigger than the limit */
+  memmove(U.b, U.b + keep, U.len - keep);
+  U.len -= keep; U.cur -= keep; U.last -= keep;
+}
+
+void undoRecord(int type, int row, int col, const char *d, int dlen, const char *ins, int ilen) {
+  journalRecord(type, row, col, d, dlen, ins, ilen);
+  if (U.applying) return;
+  int start = U.brk;
+  U.brk = 0;
+  if (start) U.lost = 0;
+  if (U.lost) return;
+  U.len = U.cur; /* A new change forgets what could be redone */
+  uop o = {type, start, row, col, dlen, ilen};
+  if (!start && type == UNDO_SPLICE && !dlen && U.len) { /* Typing on: extend the last insert */
+    uop p;
+    memcpy(&p, U.b + U.last, sizeof(uop));
+    if (p.type == UNDO_SPLICE && !p.dlen && p.row == row && p.col + p.ilen == col && U.last + uopSize(&p) == U.len) {
+      p.ilen += ilen;
+      size_t sz = uopSize(&p);
+      bufGrow(&U.b, &U.cap, U.last + sz);
+      memcpy(U.b + U.last + sizeof(uop) + p.ilen - ilen, ins, ilen);
+      memcpy(U.b + U.last, &p, sizeof(uop));
+      U.len = U.cur = U.last + sz;
+      memcpy(U.b + U.len - 4, &(uint32_t){sz}, 4);
+      return;
+    }
+  }
+  size_t sz = uopPut(&U.b, &U.cap, U.len, &o, d, ins);
+  U.last = U.len;
+  U.len = U.cur = U.len + sz;
+  if (U.len > U.limit) undoTrim();
+}
+
+/* Apply a record forwards (redo, replay) or backwards (undo). */
+void uopApply(const char *rec, int forward) {
+  uop o;
+  memcpy(&o, rec, sizeof(uop));
+  const char *d = rec + sizeof(uop), *ins = d + o.dlen;
+  editorIndexTo(o.row + 2);
+  int type = o.type;
+  if (!forward) { /* The inverse: swap what was deleted and inserted */
+    const char *t = d; d = ins; ins = t;
+    int n = o.dlen; o.dlen = o.ilen; o.ilen = n;
+    if (type != UNDO_SPLICE) type = type == UNDO_ROWINS ? UNDO_ROWDEL : UNDO_ROWINS;
+  }
+  if (type == UNDO_ROWINS) editorInsertRow(o.row, (char *)ins, o.ilen);
+  else if (type == UNDO_ROWDEL) editorDelRow(o.row);
+  else {
+    erow *row = editorRowAt(o.row);
+    size_t len = row->size - o.dlen + o.ilen;
+    char *b = bufGrow(&E.scratch, &E.scratchcap, len);
+    memcpy(b, row->chars, o.col);
+    memcpy(b + o.col, ins, o.ilen);
+    memcpy(b + o.col + o.ilen, row->chars + o.col + o.dlen, row->size - o.col - o.dlen);
+    editorRowSet(row, b, len);
+    E.dirty++;
+  }
+  E.cy = o.row < E.numrows ? o.row : E.numrows;
+  E.cx = type == UNDO_SPLICE ? o.col + o.ilen : 0;
+}
+
+void editorUndo(int redo) {
+  size_t off;
+  uop o;
+  U.applying = 1;
+  if (!redo) {
+    if (U.cur == 0) { snprintf(E.statusmsg, sizeof(E.statusmsg), "Nothing to undo"); U.applying = 0; return; }
+    do {
+      uint32_t sz;
+      memcpy(&sz, U.b + U.cur - 4, 4);
+      U.cur -= sz;
+      uopApply(U.b + U.cur, 0);
+      memcpy(&o, U.b + U.cur, sizeof(uop));
+    } while (!o.start && U.cur > 0);
+  } else {
+    if (U.cur == U.len) { snprintf(E.statusmsg, sizeof(E.statusmsg), "Nothing to redo"); U.applying = 0; return; }
+    do {
+      off = U.cur;
+      uopApply(U.b + off, 1);
+      memcpy(&o, U.b + off, sizeof(uop));
+      U.cur += uopSize(&o);
+      if (U.cur < U.len) memcpy(&o, U.b + U.cur, sizeof(uop));
+    } while (U.cur < U.len && !o.start);
+  }
+  U.applying = 0;
+  undoBreak();
+  snprintf(E.statusmsg, sizeof(E.statusmsg), redo ? "Redo" : "Undo");
+}
+
+/* --- Journal --- */
+
+/* With -j every change is also appended to a sidecar journal, .<name>.qj,
+ * in the undo log's record format, after a header naming the file state
+ * (size and mtime) the changes apply to. Records are buffered and written
+ * in batches while idle, with an fdatasync at most every Q_JOURNAL_SYNC
+ * seconds. After a crash the next open offers to replay the journal, which
+ * costs as much as the edits, not the file. A save restarts the journal
+ * from the saved state; quitting removes it. */
+struct jheader { char magic[4]; int64_t size, mtime, mtimens; };
+
+struct journal {
+  int fd;            /* -1 when journaling is off */
+  char *path;
+  char *buf;         /* records not yet written */
+  size_t len, cap;
+  off_t size;        /* bytes in the file */
+  int unsynced, replaying;
+  double lastsync;
+} J = {.fd = -1};
+
+void journalHeader(struct jheader *h, const char *file) {
+  struct stat st;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "QJ1\n", 4);
+  h->size = -1;
+  if (stat(file, &st) == 0) { h->size = st.st_size; h->mtime = st.st_mtim.tv_sec; h->mtimens = st.st_mtim.tv_nsec; }
+}
+
+void journalFlush() {
+  size_t off = 0;
+  while (off < J.len) {
+    ssize_t w = pwrite(J.fd, J.buf + off, J.len - off, J.size);
+    if (w <= 0) { if (w == -1 && errno == EINTR) continue; break; }
+    off += w; J.size += w;
+  }
+  J.len = 0;
+  J.unsynced = 1;
+}
+
+void journalRecord(int type, int row, int col, const char *d, int dlen, const char *ins, int ilen) {
+  if (J.fd == -1 || J.replaying) return;
+  uop o = {type, 0, row, col, dlen, ilen};
+  J.len += uopPut(&J.buf, &J.cap, J.len, &o, d, ins);
+  if (J.len >= Q_JOURNAL_BUF) journalFlush();
+}
+
+/* Idle step: write what is buffered and sync now and then. */
+void journalIdle() {
+  if (J.fd == -1) return;
+  if (J.len) journalFlush();
+  if (J.unsynced && editorNow() - J.lastsync >= Q_JOURNAL_SYNC) {
+    fdatasync(J.fd);
+    J.unsynced = 0;
+    J.lastsync = editorNow();
+  }
+}
+
+/* Start the journal over for the file as just saved, keeping the records
+ * from 'from' on: changes made while the save was running. */
+void journalRebase(const char *file, off_t from) {
+  if (J.fd == -1) return;
+  journalFlush();
+  struct jheader h;
+  journalHeader(&h, file);
+  off_t n = J.size - from, at = sizeof(h), got;
+  char *tail = malloc(n > 0 ? n : 1);
+  for (got = 0; got < n; ) { ssize_t r = pread(J.fd, tail + got, n - got, from + got); if (r <= 0) break; got += r; }
+  pwrite(J.fd, &h, sizeof(h), 0);
+  if (got) pwrite(J.fd, tail, got, at);
+  J.size = at + got;
+  ftruncate(J.fd, J.size);
+  free(tail);
+  J.unsynced = 1;
+}
+
+/* Logical end of the journal, buffered records included. */
+off_t journalOffset() { return J.fd == -1 ? 0 : J.size + J.len; }
+
+/* Replay the records of a journal left behind for this file, if the user
+ * wants them; then journal on from there. */
+void journalOpen(const char *file) {
+  char *slash = strrchr(file, '/');
+  J.path = malloc(strlen(file) + 5);
+  sprintf(J.path, "%.*s.%s.qj", slash ? (int)(slash - file + 1) : 0, file, slash ? slash + 1 : file);
+  struct jheader want, h;
+  journalHeader(&want, file);
+  int fd = open(J.path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) return;
+  struct stat st;
+  off_t end = sizeof(h);
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(h) && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+      memcmp(&h, &want, sizeof(h)) == 0) {
+    char *b = malloc(st.st_size), *ans;
+    ssize_t got = pread(fd, b, st.st_size, 0);
+    editorScheduleFrame();
+    editorFrame(1);
+    ans = editorPrompt("Unsaved changes found in the journal. Replay them? (y/n) ");
+    if (ans && (ans[0] == 'y' || ans[0] == 'Y')) {
+      size_t off = sizeof(h);
+      int n = 0;
+      uop o;
+      J.replaying = 1;
+      undoBreak();
+      while (off + sizeof(uop) + 4 <= (size_t)got) { /* Stop at a record cut short by the crash */
+        memcpy(&o, b + off, sizeof(uop));
+        size_t sz = uopSize(&o);
+        uint32_t tail;
+        if (o.type > UNDO_ROWDEL || o.dlen < 0 || o.ilen < 0 || off + sz > (size_t)got) break;
+        memcpy(&tail, b + off + sz - 4, 4);
+        if (tail != sz) break;
+        uopApply(b + off, 1);
+        off += sz; n++;
+      }
+      J.replaying = 0;
+      end = off;
+      snprintf(E.statusmsg, sizeof(E.statusmsg), "Replayed %d changes", n);
+      E.msgtime = 0;
+    }
+    free(ans); free(b);
+  }
+  pwrite(fd, &want, sizeof(want), 0);
+  ftruncate(fd, end);
+  J.fd = fd;
+  J.size = end;
+  J.lastsync = editorNow();
+}
+
+/* Quitting on purpose: the journal is no longer needed. */
+void journalClose() {
+  if (J.fd == -1) return;
+  close(J.fd);
+  unlink(J.path);
+  J.fd = -1;
+}
+
+/* --- Line scanning --- */
+
+/* Bitmask of the '\n' bytes in the 32 bytes at p. */
+unsigned scanNewlines32(const char *p) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+#elif defined(__SSE2__)
+  __m128i nl = _mm_set1_epi8('\n');
+  unsigned lo = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+  unsigned hi = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+  return lo | hi << 16;
+#else
+  unsigned m = 0;
+  int i;
+  for (i = 0; i < 32; i++) m |= (unsigned)(p[i] == '\n') << i;
+  return m;
+#endif
+}
+
+/* Bitmask of the bytes in the 32 at p that aren't one column each: control
+ * bytes (below ' ', and DEL) and non-ASCII ones, whose top bit is set. */
+unsigned scanSpecial32(const char *p) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  return _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(31)), v),
+                                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127))), v));
+#elif defined(__SSE2__)
+  __m128i us = _mm_set1_epi8(31), del = _mm_set1_epi8(127);
+  __m128i a = _mm_loadu_si128((const __m128i *)p), b = _mm_loadu_si128((const __m128i *)(p + 16));
+  unsigned lo = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(a, us), a), _mm_cmpeq_epi8(a, del)), a));
+  unsigned hi = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(b, us), b), _mm_cmpeq_epi8(b, del)), b));
+  return lo | hi << 16;
+#else
+  unsigned m = 0;
+  int i;
+  for (i = 0; i < 32; i++) m |= (unsigned)((unsigned char)p[i] < 32 || (unsigned char)p[i] >= 127) << i;
+  return m;
+#endif
+}
+
+/* Bitmask of the brackets - ()[]{} - in the 32 bytes at p. '[' and ']'
+ * with bit 5 set are '{' and '}', and '(' ')' differ only in bit 0. */
+unsigned scanBrackets32(const char *p) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *)p), u = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  return _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(u, _mm256_set1_epi8('}'))),
+                                              _mm256_cmpeq_epi8(_mm256_and_si256(v, _mm256_set1_epi8((char)0xfe)), _mm256_set1_epi8('('))));
+#elif defined(__SSE2__)
+  __m128i sp = _mm_set1_epi8(0x20), ob = _mm_set1_epi8('{'), cb = _mm_set1_epi8('}'), pm = _mm_set1_epi8((char)0xfe), op = _mm_set1_epi8('(');
+  __m128i a = _mm_loadu_si128((const __m128i *)p), b = _mm_loadu_si128((const __m128i *)(p + 16));
+  __m128i ua = _mm_or_si128(a, sp), ub = _mm_or_si128(b, sp);
+  unsigned lo = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(ua, ob), _mm_cmpeq_epi8(ua, cb)), _mm_cmpeq_epi8(_mm_and_si128(a, pm), op)));
+  unsigned hi = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(ub, ob), _mm_cmpeq_epi8(ub, cb)), _mm_cmpeq_epi8(_mm_and_si128(b, pm), op)));
+  return lo | hi << 16;
+#else
+  unsigned m = 0;
+  int i;
+  for (i = 0; i < 32; i++) m |= (unsigned)((p[i] | 0x20) == '{' || (p[i] | 0x20) == '}' || (p[i] & 0xfe) == '(') << i;
+  return m;
+#endif
+}
+
+/* Bitmask of the positions i in p[0..32) where p[i] == first and p[i+k] == last. */
+unsigned scanPair32(const char *p, int k, char first, char last) {
+#if defined(__AVX2__)
+  __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi8(first));
+  __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + k)), _mm256_set1_epi8(last));
+  return _mm256_movemask_epi8(_mm256_and_si256(a, b));
+#elif defined(__SSE2__)
+  __m128i f = _mm_set1_epi8(first), l = _mm_set1_epi8(last);
+  unsigned lo = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), f),
+                                                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + k)), l)));
+  unsigned hi = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), f),
+                                                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 + k)), l)));
+  return lo | hi << 16;
+#else
+  unsigned m = 0;
+  int i;
+  for (i = 0; i < 32; i++) m |= (unsigned)(p[i] == first && p[i + k] == last) << i;
+  return m;
+#endif
+}
+
+/* Offset of the first occurrence of lit[0..m) in s[0..n), or -1. Candidates
+ * are positions whose first and last bytes both match, 32 at a time, so
+ * memcmp only runs on likely hits. The short tail (most rows are shorter
+ * than a block) is checked byte by byte, which beats memmem's setup cost. */
+int litFind(const char *s, int n, const char *lit, int m) {
+  const char *p = s, *end = s + n - m;
+  if (m == 0) return 0;
+  if (n < m) return -1;
+  if (m == 1) { p = memchr(s, lit[0], n); return p ? p - s : -1; }
+  for (; end - p >= 32; p += 32) {
+    unsigned mask = scanPair32(p, m - 1, lit[0], lit[m - 1]);
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(p + i + 1, lit + 1, m - 2) == 0) return p + i - s;
+      mask &= mask - 1;
+    }
+  }
+  for (; p <= end; p++)
+    if (p[0] == lit[0] && p[m - 1] == lit[m - 1] && memcmp(p + 1, lit + 1, m - 2) == 0) return p - s;
+  return -1;
+}
+
+/* Split buf[0..len) into view rows appended after chunk 'tail' (normally
+ * ropeLast()), stopping after 'max' rows. A final line without '\n' becomes
+ * a row too. Newlines are found 32 bytes at a time and every line in a block
+ * is emitted from its mask, so short lines don't pay a memchr call each.
+ * Control and non-ASCII bytes are found in the same pass, so only the
+ * lines that have them are marked for rendering. Returns bytes consumed. */
+size_t editorScanLines(rnode *tail, char *buf, size_t len, int max) {
+  char *p = buf, *end = buf + len, *line = buf;
+  int n = 0, carry = 0; /* carry: the line so far has control bytes */
+  while (n < max && p < end) {
+    unsigned m = 0, c = 0, cr;
+    if (end - p >= 32) { m = scanNewlines32(p); c = scanSpecial32(p); }
+    else {
+      int i;
+      for (i = 0; i < end - p; i++) {
+        m |= (unsigned)(p[i] == '\n') << i;
+        c |= (unsigned)((unsigned char)p[i] < 32 || (unsigned char)p[i] >= 127) << i;
+      }
+    }
+    c &= ~m;
+    for (cr = c & m >> 1; cr; cr &= cr - 1) /* A '\r' ending a line is dropped, not shown */
+      if (p[__builtin_ctz(cr)] == '\r') c &= ~(cr & -cr);
+    while (m && n < max) {
+      unsigned upto = m ^ (m - 1); /* This line's bytes in the block */
+      char *nl = p + __builtin_ctz(m);
+      m &= m - 1;
+      size_t l = nl - line;
+      while (l > 0 && line[l - 1] == '\r') l--;
+      erow *row = ropeAppend(&tail);
+      row->size = l; row->cap = 0; row->chars = line;
+      row->render = carry || (c & upto) ? RENDER_STALE : NULL;
+      tail->nvis += row->h = editorRowCol(row, l) / E.wrapw + 1;
+      c &= ~upto; carry = 0;
+      line = nl + 1; n++;
+    }
+    if (!m) { carry |= c != 0; p += 32; }
+  }
+  if (n < max && line < end && p >= end) {
+    size_t l = end - line;
+    while (l > 0 && line[l - 1] == '\r') l--;
+    erow *row = ropeAppend(&tail);
+    row->size = l; row->cap = 0; row->chars = line;
+    row->render = carry ? RENDER_STALE : NULL;
+    tail->nvis += row->h = editorRowCol(row, l) / E.wrapw + 1;
+    line = end;
+  }
+  if (tail) ropeFixUp(tail);
+  return line - buf;
+}
+
+/* Offset just past the k-th newline in p[0..n), or n if there are fewer. */
+size_t lineOffset(const char *p, size_t n, int k) {
+  size_t i = 0;
+  if (k <= 0) return 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned m = scanNewlines32(p + i);
+    int c = __builtin_popcount(m);
+    if (c < k) { k -= c; continue; }
+    while (--k) m &= m - 1;
+    return i + __builtin_ctz(m) + 1;
+  }
+  for (; i < n; i++) if (p[i] == '\n' && --k == 0) return i + 1;
+  return n;
+}
+
+/* Newlines in p[0..n). */
+size_t countNewlines(const char *p, size_t n) {
+  size_t c = 0, i = 0;
+  for (; i + 32 <= n; i += 32) c += __builtin_popcount(scanNewlines32(p + i));
+  for (; i < n; i++) c += p[i] == '\n';
+  return c;
+}
+
+/* --- Row display --- */
+
+/* Whether s[0..n) has bytes that don't show as one column each. */
+int editorHasSpecial(const char *s, int n) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) if (scanSpecial32(s + i)) return 1;
+  for (; i < n; i++) if ((unsigned char)s[i] < 32 || (unsigned char)s[i] >= 127) return 1;
+  return 0;
+}
+
+/* Length of the UTF-8 character at s[0..n), with its code point in *cp;
+ * an invalid or cut-off sequence is one byte with *cp = -1. */
+int utf8Decode(const unsigned char *s, int n, int *cp) {
+  int c = s[0], len, i;
+  *cp = -1;
+  if (c < 0x80) { *cp = c; return 1; }
+  if (c >= 0xc2 && c < 0xe0) { len = 2; c &= 0x1f; }
+  else if (c >= 0xe0 && c < 0xf0) { len = 3; c &= 0x0f; }
+  else if (c >= 0xf0 && c < 0xf5) { len = 4; c &= 0x07; }
+  else return 1;
+  if (len > n) return 1;
+  for (i = 1; i < len; i++) {
+    if ((s[i] & 0xc0) != 0x80) return 1;
+    c = c << 6 | (s[i] & 0x3f);
+  }
+  if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) || (len == 4 && (c < 0x10000 || c > 0x10ffff))) return 1;
+  *cp = c;
+  return len;
+}
+
+/* Columns code point c takes: 0 for combining marks and other zero-width
+ * characters, 2 for wide ones (CJK, emoji), -1 for ones not to be sent to
+ * the terminal as they are (C1 and bidi controls), 1 otherwise. */
+int ucWidth(int c) {
+  static const int zero[][2] = {
+    {0x300, 0x36f}, {0x483, 0x489}, {0x591, 0x5bd}, {0x610, 0x61a}, {0x64b, 0x65f}, {0x670, 0x670},
+    {0x6d6, 0x6dc}, {0x900, 0x903}, {0x93a, 0x94f}, {0xe31, 0xe31}, {0xe34, 0xe3a}, {0xe47, 0xe4e},
+    {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200d}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1f3fb, 0x1f3ff}, {0xe0100, 0xe01ef}};
+  static const int wide[][2] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x25fd, 0x25fe},
+    {0x2614, 0x2615}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x2705, 0x2705}, {0x274c, 0x274c},
+    {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0xa4cf}, {0xa960, 0xa97f},
+    {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+    {0xffe0, 0xffe6}, {0x1f004, 0x1f004}, {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f900, 0x1f9ff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd}};
+  unsigned i;
+  if (c < 0xa0 || (c >= 0x202a && c <= 0x202e) || (c >= 0x2066 && c <= 0x2069)) return -1;
+  if (c < 0x300) return 1;
+  for (i = 0; i < sizeof(zero) / sizeof(zero[0]); i++) if (c >= zero[i][0] && c <= zero[i][1]) return 0;
+  for (i = 0; i < sizeof(wide) / sizeof(wide[0]); i++) if (c >= wide[i][0] && c <= wide[i][1]) return 2;
+  return 1;
+}
+
+/* Lay the row out at E.wrapw and return the place (screen line * E.wrapw +
+ * column) of the character holding byte 'at'. Tabs go to the next stop,
+ * control bytes show as ^X, invalid UTF-8 as U+FFFD, a wide character that
+ * would straddle the edge moves to the next line and a combining mark is
+ * placed with its base. With 'r', the row up to 'at' is also counted into
+ * r->len (bytes) and filled into whichever of r->col, r->line and r->b are set. */
+int editorRowLayout(erow *row, int at, erender *r) {
+  const unsigned char *s = (const unsigned char *)row->chars;
+  int w = E.wrapw, i = 0, pos = 0, base = 0, lcol = 0, nline = 0, k;
+  while (i < row->size) {
+    char cell[4];
+    int n = 1, wd, cp, clen = 1, cells = 1;
+    if (s[i] == '\t') { wd = cells = Q_TABSTOP - lcol % Q_TABSTOP; cell[0] = ' '; }
+    else if (s[i] < 32 || s[i] == 127) wd = cells = 2;
+    else if (s[i] < 128) { wd = 1; cell[0] = s[i]; }
+    else {
+      n = utf8Decode(s + i, row->size - i, &cp);
+      wd = cp < 0 ? -1 : ucWidth(cp);
+      if (wd < 0) { wd = 1; memcpy(cell, "\xef\xbf\xbd", clen = 3); }
+      else memcpy(cell, s + i, clen = n);
+    }
+    if (wd == 2 && cells == 1 && w > 1 && pos % w == w - 1) { /* Pad, and start it on the next line */
+      if (r && r->line) while (nline <= pos / w) r->line[nline++] = r->len;
+      if (r && r->b) r->b[r->len] = ' ';
+      if (r) r->len++;
+      pos++;
+    }
+    if (wd) base = pos;
+    if (at < i + n) return base;
+    if (r && r->col) for (k = 0; k < n; k++) r->col[i + k] = base;
+    for (k = 0; k < cells; k++) { /* A tab or ^X is cells of one column, which may wrap */
+      if (cells > 1 && s[i] != '\t') cell[0] = k ? (s[i] == 127 ? '?' : s[i] + 64) : '^';
+      int cw = cells > 1 ? 1 : wd;
+      if (cw && r && r->line) while (nline <= pos / w) r->line[nline++] = r->len;
+      if (r && r->b) memcpy(r->b + r->len, cell, clen);
+      if (r) r->len += clen;
+      pos += cw;
+    }
+    lcol += wd;
+    i += n;
+  }
+  if (r && r->col) r->col[row->size] = pos;
+  if (r && r->line) while (nline <= pos / w + 1) r->line[nline++] = r->len;
+  return pos;
+}
+
+/* Place of byte 'at' as editorRowLayout() has it: the byte itself for rows
+ * that show as they are, the column map once the render is built. */
+int editorRowCol(erow *row, int at) {
+  if (!row->render) return at;
+  if (row->render != RENDER_STALE && row->render->w == E.wrapw) return row->render->col[at];
+  return editorRowLayout(row, at, NULL);
+}
+
+/* The row's render at E.wrapw, built on first use and kept until the row
+ * changes; NULL if it shows as it is. */
+erender *editorRowRender(erow *row) {
+  if (!row->render || (row->render != RENDER_STALE && row->render->w == E.wrapw)) return row->render;
+  editorRenderFree(row);
+  if (!editorHasSpecial(row->chars, row->size)) return NULL; /* Marked by a stray '\r' */
+  erender t = {0};
+  int h = editorRowLayout(row, row->size, &t) / E.wrapw + 1;
+  erender *r = malloc(sizeof(erender) + sizeof(int) * (row->size + h + 2) + t.len);
+  r->col = (int *)(r + 1);
+  r->line = r->col + row->size + 1;
+  r->b = (char *)(r->line + h + 1);
+  r->w = E.wrapw; r->len = 0;
+  editorRowLayout(row, row->size, r);
+  return row->render = r;
+}
+
+void editorRenderFree(erow *row) {
+  if (row->render != RENDER_STALE) free(row->render);
+  row->render = NULL;
+}
+
+/* Byte of the next (dir 1) or previous (dir -1) character from 'at'; a
+ * character and the combining marks after it count as one. */
+int editorRowStep(erow *row, int at, int dir) {
+  erender *r = editorRowRender(row);
+  at += dir;
+  if (r) while (at > 0 && at < row->size && r->col[at - 1] == r->col[at]) at += dir;
+  return at;
+}
+
+/* 'at' moved back to the start of its character, if it is inside one. */
+int editorRowSnap(erow *row, int at) {
+  erender *r = editorRowRender(row);
+  if (r) while (at > 0 && at < row->size && r->col[at - 1] == r->col[at]) at--;
+  return at;
+}
+
+/* --- Mapped files --- */
+
+/* File contents are read once per process: buffers opened on the same file
+ * (same inode, size and mtime) share its mapping or load buffer, and their
+ * rows are views into it until edited. */
+struct backing {
+  dev_t dev; ino_t ino; off_t size; struct timespec mtime;
+  char *buf;
+  size_t len;
+  size_t maplen; /* bytes mapped; len drops below it if the file is cut short */
+  int fd;   /* the mapped file; -1 for a load buffer */
+  int refs; /* buffers using it; 0 = free slot */
+  int shrunk;    /* times the file was found cut short */
+  int priv;      /* every page is a private copy, so none can fault */
+  size_t *ck;    /* mapped files: byte offset of line i * Q_CHECKPOINT */
+  int nck, ckcap;
+  size_t ckscan; /* bytes line-counted so far */
+  int cktail;    /* lines counted past the last checkpoint */
+} *BK;
+int nbk;
+
+int backingFind(struct stat *st) {
+  int i;
+  for (i = 0; i < nbk; i++)
+    if (BK[i].refs && BK[i].dev == st->st_dev && BK[i].ino == st->st_ino && BK[i].size == st->st_size &&
+        BK[i].mtime.tv_sec == st->st_mtim.tv_sec && BK[i].mtime.tv_nsec == st->st_mtim.tv_nsec) return i;
+  return -1;
+}
+
+int backingAdd(struct stat *st, char *buf, size_t len, int fd) {
+  int i;
+  for (i = 0; i < nbk && BK[i].refs; i++);
+  if (i == nbk) BK = realloc(BK, sizeof(*BK) * ++nbk);
+  BK[i] = (struct backing){.dev = st->st_dev, .ino = st->st_ino, .size = st->st_size, .mtime = st->st_mtim,
+                           .buf = buf, .len = len, .maplen = len, .fd = fd, .refs = 1};
+  if (fd != -1) { BK[i].ck = malloc(sizeof(size_t) * (BK[i].ckcap = 64)); BK[i].ck[BK[i].nck++] = 0; }
+  return i;
+}
+
+/* A buffer lets go of its file contents; the last one frees them. */
+void backingRelease(int i) {
+  if (i < 0 || --BK[i].refs) return;
+  if (BK[i].fd != -1) { munmap(BK[i].buf, BK[i].maplen); close(BK[i].fd); }
+  else free(BK[i].buf);
+  free(BK[i].ck);
+}
+
+/* A mapped file is line-counted in the background, noting the offset of
+ * every Q_CHECKPOINT-th line, and each counted stretch joins the rope as one
+ * lazy chunk. So a jump anywhere costs a count (or nothing, once the index
+ * is cached) plus splitting a single chunk into rows. The finished index is
+ * kept in ~/.cache/quecto, keyed by inode and checked against size and mtime. */
+struct ckheader { char magic[4]; int32_t per, tail; int64_t dev, ino, size, mtime, mtimens, nck; };
+
+void backingIndexHeader(struct backing *b, struct ckheader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "QX1\n", 4);
+  h->per = Q_CHECKPOINT; h->tail = b->cktail;
+  h->dev = b->dev; h->ino = b->ino; h->size = b->size;
+  h->mtime = b->mtime.tv_sec; h->mtimens = b->mtime.tv_nsec;
+  h->nck = b->nck;
+}
+
+/* Path of the index cache for b; 'mk' creates the directories. Benchmark
+ * builds, whose files are generated fresh each run, keep none. */
+char *backingIndexPath(struct backing *b, int mk) {
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  char dir[PATH_MAX], *path;
+#ifdef Q_BENCH
+  return NULL;
+#endif
+  if (xdg && *xdg) snprintf(dir, sizeof(dir), "%s/quecto", xdg);
+  else if (home && *home) snprintf(dir, sizeof(dir), "%s/.cache/quecto", home);
+  else return NULL;
+  if (mk) { char *s = strrchr(dir, '/'); *s = 0; mkdir(dir, 0700); *s = '/'; mkdir(dir, 0700); }
+  path = malloc(strlen(dir) + 48);
+  sprintf(path, "%s/%llx-%llx.qx", dir, (unsigned long long)b->dev, (unsigned long long)b->ino);
+  return path;
+}
+
+void backingIndexLoad(struct backing *b) {
+  char *path = backingIndexPath(b, 0);
+  int fd = path ? open(path, O_RDONLY) : -1;
+  struct ckheader want, h;
+  free(path);
+  if (fd == -1) return;
+  backingIndexHeader(b, &want);
+  if (read(fd, &h, sizeof(h)) == sizeof(h) && memcmp(h.magic, want.magic, 4) == 0 && h.per == want.per &&
+      h.dev == want.dev && h.ino == want.ino && h.size == want.size && h.mtime == want.mtime &&
+      h.mtimens == want.mtimens && h.nck > 0 && h.nck < INT_MAX) {
+    size_t *ck = malloc(sizeof(size_t) * h.nck), bytes = sizeof(size_t) * h.nck;
+    if (read(fd, ck, bytes) == (ssize_t)bytes && ck[0] == 0) {
+      free(b->ck);
+      b->ck = ck; b->nck = b->ckcap = h.nck;
+      b->cktail = h.tail;
+      b->ckscan = b->len;
+    } else free(ck);
+    futimens(fd, NULL); /* Used: the last to be pruned */
+  }
+  close(fd);
+}
+
+/* Remove the least recently used indexes beyond Q_INDEX_CACHE from the
+ * cache directory holding 'path'. */
+void backingIndexPrune(const char *path) {
+  char *dir = strndup(path, strrchr(path, '/') - path), file[PATH_MAX];
+  struct { time_t at; char name[64]; } *v = NULL, t;
+  int n = 0, cap = 0, i, j;
+  struct dirent *d;
+  struct stat st;
+  DIR *dp = opendir(dir);
+  while (dp && (d = readdir(dp))) {
+    size_t l = strlen(d->d_name);
+    if (l < 4 || l >= sizeof(t.name) || strcmp(d->d_name + l - 3, ".qx") != 0) continue;
+    snprintf(file, sizeof(file), "%s/%s", dir, d->d_name);
+    if (stat(file, &st) == -1) continue;
+    if (n == cap) v = realloc(v, sizeof(*v) * (cap = cap ? cap * 2 : 64));
+    v[n].at = st.st_mtime; strcpy(v[n++].name, d->d_name);
+  }
+  if (dp) closedir(dp);
+  for (i = 0; i < n - Q_INDEX_CACHE; i++) { /* The oldest first */
+    for (j = i + 1; j < n; j++) if (v[j].at < v[i].at) { t = v[i]; v[i] = v[j]; v[j] = t; }
+    snprintf(file, sizeof(file), "%s/%s", dir, v[i].name);
+    unlink(file);
+  }
+  free(v); free(dir);
+}
+
+void backingIndexSave(struct backing *b) {
+  char *path = backingIndexPath(b, 1), *tmp;
+  struct ckheader h;
+  if (!path) return;
+  tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp), ok = 0;
+  if (fd != -1) {
+    backingIndexHeader(b, &h);
+    ok = write(fd, &h, sizeof(h)) == sizeof(h) &&
+         write(fd, b->ck, sizeof(size_t) * b->nck) == (ssize_t)(sizeof(size_t) * b->nck);
+    close(fd);
+    if (!ok || rename(tmp, path) == -1) unlink(tmp);
+    else backingIndexPrune(path);
+  }
+  free(tmp); free(path);
+}
+
+/* Count the lines in about 'bytes' more of b, noting checkpoints. */
+void backingCount(struct backing *b, size_t bytes) {
+  char *p = b->buf + b->ckscan, *end = b->buf + b->len;
+  if ((size_t)(end - p) > bytes) end = p + (bytes & ~(size_t)31);
+  for (; end - p >= 32; p += 32) {
+    unsigned m = scanNewlines32(p);
+    int c = __builtin_popcount(m);
+    if (b->cktail + c < Q_CHECKPOINT) { b->cktail += c; continue; }
+    for (; m; m &= m - 1) {
+      if (++b->cktail < Q_CHECKPOINT) continue;
+      if (b->nck == b->ckcap) b->ck = realloc(b->ck, sizeof(size_t) * (b->ckcap *= 2));
+      b->ck[b->nck++] = p + __builtin_ctz(m) + 1 - b->buf;
+      b->cktail = 0;
+    }
+  }
+  if (end == b->buf + b->len) { /* The last few bytes, one by one */
+    for (; p < end; p++) {
+      if (*p != '\n' || ++b->cktail < Q_CHECKPOINT) continue;
+      if (b->nck == b->ckcap) b->ck = realloc(b->ck, sizeof(size_t) * (b->ckcap *= 2));
+      b->ck[b->nck++] = p + 1 - b->buf;
+      b->cktail = 0;
+    }
+    backingIndexSave(b);
+  }
+  b->ckscan = p - b->buf;
+}
+
+rnode *ropeNewLazy(char *p, size_t len, int lines) {
+  rnode *n = calloc(1, sizeof(rnode));
+  n->prio = ropeRand();
+  n->lazy = n->nvis = lines;
+  n->lp = p; n->llen = len;
+  n->stale = 1;
+  ropePull(n);
+  return n;
+}
+
+/* Replace a lazy chunk by real chunks of view rows; returns the first. */
+rnode *ropeExpand(rnode *n) {
+  int lines = n->lazy;
+  editorScanLines(n, n->lp, n->llen, INT_MAX);
+  rnode *first = ropeNext(n);
+  ropeRemove(n);
+  E.numrows -= lines; /* Counted once as lazy lines and again as rows */
+  E.rcache = NULL;
+  return first;
+}
+
+/* Split only the Q_EXPAND lines of lazy chunk n around its line k into
+ * rows, leaving lazy chunks before and after them: showing the first
+ * screen of a big file then costs a few thousand lines, not a chunk's worth. */
+void ropeExpandAt(rnode *n, int k) {
+  if (n->lazy <= Q_EXPAND) { ropeExpand(n); return; }
+  int s = k / Q_EXPAND * Q_EXPAND, e = s + Q_EXPAND < n->lazy ? s + Q_EXPAND : n->lazy;
+  size_t from = lineOffset(n->lp, n->llen, s), to = e == n->lazy ? n->llen : lineOffset(n->lp, n->llen, e);
+  if (e < n->lazy) ropeInsertAfter(n, ropeNewLazy(n->lp + to, n->llen - to, n->lazy - e));
+  editorScanLines(n, n->lp + from, to - from, INT_MAX);
+  E.numrows -= e - s; /* Counted once as lazy lines and again as rows */
+  E.rcache = NULL;
+  if (!s) { ropeRemove(n); return; }
+  n->lazy = n->nvis = s; n->llen = from;
+  n->stale = 1;
+  ropeFixUp(n);
+}
+
+/* Count on through about 'bytes' of the mapping if needed, and add what
+ * has been counted to the rope as lazy chunks. */
+void editorMapScan(size_t bytes) {
+  struct backing *b = &BK[E.backing];
+  if (E.mapck + 1 >= b->nck && b->ckscan < b->len) backingCount(b, bytes);
+  while (E.mapscan < b->len) {
+    size_t to;
+    int lines = Q_CHECKPOINT;
+    if (E.mapck + 1 < b->nck) to = b->ck[++E.mapck];
+    else if (b->ckscan == b->len) { to = b->len; lines = b->cktail + (b->buf[b->len - 1] != '\n'); }
+    else break;
+    rnode *m = ropeNewLazy(E.map + E.mapscan, to - E.mapscan, lines), *t = ropeLast();
+    if (t) ropeInsertAfter(t, m); else E.rope = m;
+    E.numrows += lines;
+    E.rcache = NULL;
+    E.mapscan = to;
+  }
+  if (E.mapscan == b->len) traceMark("index");
+}
+
+/* Make sure at least 'rows' rows exist (or the whole file is indexed). */
+void editorIndexTo(int rows) {
+  while (E.numrows < rows && E.mapscan < E.mapsize) editorMapScan(1 << 20);
+}
+
+/* Another process cut the mapped file b to 'keep' bytes (a truncate, a
+ * copytruncate log rotation): reading a page past its new end would raise
+ * SIGBUS. The pages up to it become private copies and the rest anonymous
+ * zeros, so every view stays readable; the text past 'keep' is gone. */
+void backingShrink(struct backing *b, size_t keep) {
+  size_t page = sysconf(_SC_PAGESIZE), top = (keep + page - 1) / page * page, off;
+  if (top > b->maplen) top = b->maplen;
+  if (top && mprotect(b->buf, top, PROT_READ | PROT_WRITE) == 0) {
+    for (off = 0; off < top; off += page) ((volatile char *)b->buf)[off] = b->buf[off];
+    mprotect(b->buf, top, PROT_READ);
+  }
+  if (top < b->maplen) mmap(b->buf + top, b->maplen - top, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  b->len = keep;
+  while (b->nck > 1 && b->ck[b->nck - 1] > keep) b->nck--;
+  if (b->ckscan > keep) { b->ckscan = b->ck[b->nck - 1]; b->cktail = 0; }
+  b->shrunk++;
+  b->mtime.tv_nsec = -1; /* Matches no file now */
+}
+
+/* Q_CHECKPOINT newlines: the text of lines lost with the end of a file. */
+char *lostLines() {
+  static char *nl;
+  if (!nl) { nl = malloc(Q_CHECKPOINT); memset(nl, '\n', Q_CHECKPOINT); }
+  return nl;
+}
+
+/* The mapping under this buffer lost its tail: its views and lazy lines
+ * past the end become blank lines, so row numbers (and edits) stay put. */
+void editorMapLost() {
+  struct backing *b = &BK[E.backing];
+  char *end = b->buf + b->len, *top = b->buf + b->maplen;
+  rnode *n;
+  int j, lost = 0;
+  for (n = ropeFirst(); n; n = ropeNext(n)) {
+    if (n->lazy) {
+      if (n->lp < b->buf || n->lp >= top || n->lp + n->llen <= end) continue;
+      size_t have = n->lp < end ? (size_t)(end - n->lp) : 0;
+      int k = have ? countNewlines(n->lp, have) + (n->lp[have - 1] != '\n') : 0;
+      n->stale = 1;
+      if (k >= n->lazy) { n->llen = lineOffset(n->lp, have, n->lazy); ropeFixUp(n); continue; }
+      int gone = n->lazy - k;
+      lost += gone;
+      if (!k) { n->lp = lostLines(); n->llen = gone; ropeFixUp(n); continue; }
+      n->lazy = n->nvis = k; n->llen = have;
+      ropeFixUp(n);
+      ropeInsertAfter(n, ropeNewLazy(lostLines(), gone, gone));
+      n = ropeNext(n);
+      continue;
+    }
+    for (j = 0; j < n->n; j++) {
+      erow *row = &n->rows[j];
+      if (row->cap || row->chars < b->buf || row->chars >= top || row->chars + row->size <= end) continue;
+      if (row->chars >= end) { row->chars = lostLines(); row->size = 0; lost++; }
+      else row->size = end - row->chars;
+      editorUpdateRow(row);
+    }
+  }
+  if (E.mapscan > b->len) E.mapsize = E.mapscan; /* Not yet split: nothing to keep */
+  else { E.mapsize = b->len; if (E.mapck >= b->nck) E.mapck = b->nck - 1; }
+  E.mapfd = -1; /* copy_file_range would read the file as it is now */
+  E.fpos = b->len; E.fpart = b->len && end[-1] != '\n';
+  E.mapgen = b->shrunk;
+  E.rcache = NULL;
+  E.gen++; E.dirty += !E.readonly; /* Under -R there is nothing to save, so no warning on quit */
+  U.len = U.cur = 0; /* Its records may not fit the text any more */
+  char msg[80];
+  snprintf(msg, sizeof(msg), "File cut short on disk: %d lines past its end are blank", lost);
+  editorFail(msg);
+}
+
+/* Before the mapping is read: if its file was cut short since the last
+ * look, make the mapping safe and fix up this buffer. 1 if it was. */
+int editorMapCheck() {
+  struct stat st;
+  if (E.backing == -1 || BK[E.backing].fd == -1) return 0;
+  struct backing *b = &BK[E.backing];
+  if (!b->priv && fstat(b->fd, &st) == 0 && (size_t)st.st_size < b->len) backingShrink(b, st.st_size);
+  if (E.mapgen == b->shrunk) return 0;
+  editorMapLost();
+  return 1;
+}
+
+/* Line holding byte 'off' of the file as it was opened, -1 if unknown. */
+int editorLineAtOffset(size_t off) {
+  if (E.backing == -1) return -1;
+  struct backing *b = &BK[E.backing];
+  if (off >= b->len) off = b->len ? b->len - 1 : 0;
+  if (b->fd == -1) return countNewlines(b->buf, off);
+  while (b->ckscan <= off && b->ckscan < b->len) backingCount(b, Q_SCAN_SLICE);
+  int lo = 0, hi = b->nck - 1;
+  while (lo < hi) { int mid = (lo + hi + 1) / 2; if (b->ck[mid] <= off) lo = mid; else hi = mid - 1; }
+  return lo * Q_CHECKPOINT + countNewlines(b->buf + b->ck[lo], off - b->ck[lo]);
+}
+
+/* --- Structure index --- */
+
+/* Every chunk knows how its brackets move the depth (all of ()[]{} count
+ * alike, strings and comments included: no syntax is assumed), so matching
+ * brackets and neighbouring blocks are found by a descent through the rope
+ * plus a scan of one or two chunks, however big the file. */
+
+int depthOf(char c) { return c == '(' || (c | 0x20) == '{' ? 1 : -1; }
+
+int bracketAt(const char *s, int i) { return (s[i] | 0x20) == '{' || (s[i] | 0x20) == '}' || (s[i] & 0xfe) == '('; }
+
+/* Index of the first bracket in s[i..n), or n. */
+int depthNext(const char *s, int n, int i) {
+  for (; n - i >= 32; i += 32) {
+    unsigned m = scanBrackets32(s + i);
+    if (m) return i + __builtin_ctz(m);
+  }
+  for (; i < n; i++) if (bracketAt(s, i)) return i;
+  return n;
+}
+
+/* Rescan a chunk's brackets; returns the bytes looked at. */
+size_t depthSummary(rnode *n) {
+  int d = 0, lo = DEPTH_NONE, blo = DEPTH_NONE, j, i;
+  size_t bytes = 0;
+  if (n->lazy) { /* Brackets and line ends in one pass over the mapping */
+    const char *p = n->lp, *end = n->lp + n->llen;
+    for (; p < end; p += 32) {
+      unsigned m = 0;
+      if (end - p >= 32) m = scanBrackets32(p) | scanNewlines32(p);
+      else for (i = 0; i < end - p; i++) m |= (unsigned)(p[i] == '\n' || bracketAt(p, i)) << i;
+      for (; m; m &= m - 1) {
+        i = __builtin_ctz(m);
+        if (p[i] == '\n') { blo = depthMin(blo, d); continue; }
+        d += depthOf(p[i]);
+        lo = depthMin(lo, d);
+      }
+    }
+    if (n->llen && n->lp[n->llen - 1] != '\n') blo = depthMin(blo, d);
+    bytes = n->llen;
+  }
+  for (j = 0; j < n->n; j++) {
+    erow *row = &n->rows[j];
+    for (i = depthNext(row->chars, row->size, 0); i < row->size; i = depthNext(row->chars, row->size, i + 1)) {
+      d += depthOf(row->chars[i]);
+      lo = depthMin(lo, d);
+    }
+    blo = depthMin(blo, d);
+    bytes += row->size;
+  }
+  n->sd = d; n->smin = lo; n->sbmin = blo;
+  n->stale = 0;
+  ropeFixUp(n);
+  return bytes;
+}
+
+/* Rescan stale chunks, leftmost first, until about 'bytes' were looked at. */
+void editorDepthStep(size_t bytes) {
+  size_t done = 0;
+  while (E.rope && E.rope->tstale && done < bytes) {
+    rnode *n = E.rope;
+    while (!n->stale) n = n->l && n->l->tstale ? n->l : n->r;
+    done += depthSummary(n);
+  }
+}
+
+/* Depth at the start of chunk n. */
+int ropeDepthBefore(rnode *n) {
+  int d = n->l ? n->l->td : 0;
+  for (; n->p; n = n->p)
+    if (n == n->p->r) d += (n->p->l ? n->p->l->td : 0) + n->p->sd;
+  return d;
+}
+
+int depthLow(rnode *n, int lines, int subtree) { return lines ? (subtree ? n->tbmin : n->sbmin) : (subtree ? n->tmin : n->smin); }
+
+/* The nearest chunk after n (dir > 0) or before it where the depth gets
+ * to 'to' or below: after a bracket, or with 'lines' at a line end. *d is
+ * the depth at n's end (or start, going back) and becomes the depth at the
+ * found chunk's start. */
+rnode *ropeDepthSeek(rnode *n, int *d, int to, int lines, int dir) {
+  rnode *t = NULL, *s = dir > 0 ? n->r : n->l; /* First the chunks below n on that side */
+  int at = *d;
+  for (;;) {
+    if (s) { /* at: the depth where s starts going forward, or ends going back */
+      int st = dir > 0 ? at : at - s->td;
+      if (st + depthLow(s, lines, 1) <= to) { t = s; at = st; break; }
+      at = dir > 0 ? at + s->td : st;
+    }
+    for (; n->p && (dir > 0 ? n->p->l : n->p->r) != n; n = n->p) {}
+    if (!n->p) return NULL;
+    n = n->p;
+    if (dir < 0) at -= n->sd;
+    if (at + depthLow(n, lines, 0) <= to) { *d = at; return n; }
+    if (dir > 0) at += n->sd;
+    s = dir > 0 ? n->r : n->l;
+  }
+  while (t) { /* at: the depth at the start of t's subtree */
+    int ld = t->l ? t->l->td : 0;
+    rnode *first = dir > 0 ? t->l : t->r;
+    int fat = dir > 0 ? at : at + ld + t->sd;
+    if (first && fat + depthLow(first, lines, 1) <= to) { t = first; at = fat; continue; }
+    if (at + ld + depthLow(t, lines, 0) <= to) { *d = at + ld; return t; }
+    if (dir > 0) { at += ld + t->sd; t = t->r; } else t = t->l;
+  }
+  return NULL;
+}
+
+/* Walk chunk n's rows from depth d and report the first (or with 'last',
+ * the last) spot in [(k0,c0), (k1,c1)) where the depth is at most 'to':
+ * a bracket (its column), or with 'lines' a line end (the row's size).
+ * Returns the depth at (k1,c1). */
+int depthScanChunk(rnode *n, int d, int to, int lines, int k0, int c0, int k1, int c1, int last, int *hk, int *hc) {
+  int r, i;
+  for (r = 0; r < n->n && r <= k1; r++) {
+    erow *row = &n->rows[r];
+    int end = r < k1 ? row->size : c1 < row->size ? c1 : row->size;
+    for (i = depthNext(row->chars, end, 0); i < end; i = depthNext(row->chars, end, i + 1)) {
+      d += depthOf(row->chars[i]);
+      if (!lines && d <= to && (r > k0 || (r == k0 && i >= c0))) { *hk = r; *hc = i; if (!last) return d; }
+    }
+    if (r == k1) break;
+    if (lines && d <= to && (r > k0 || (r == k0 && row->size >= c0))) { *hk = r; *hc = row->size; if (!last) return d; }
+  }
+  return d;
+}
+
+/* The first spot after (row,col) (dir > 0) or the last before it
+ * (dir < 0) where the depth is at most 'to'; see depthScanChunk. Returns
+ * 0 if there is none. A lazy chunk on the way is split into rows first. */
+int editorDepthFind(int row, int col, int to, int lines, int dir, int *hr, int *hc) {
+  int k, hk = -1, d;
+  rnode *n = ropeFind(row, &k), *t;
+  editorDepthStep(SIZE_MAX);
+  d = ropeDepthBefore(n);
+  if (dir > 0) d = depthScanChunk(n, d, to, lines, k, col + 1, n->n, 0, 0, &hk, hc);
+  else depthScanChunk(n, d, to, lines, 0, 0, k, col, 1, &hk, hc);
+  if (hk >= 0) { *hr = row - k + hk; return 1; }
+  if (!(t = ropeDepthSeek(n, &d, to, lines, dir))) return 0;
+  if (t->lazy) { ropeExpand(t); return editorDepthFind(row, col, to, lines, dir, hr, hc); }
+  depthScanChunk(t, d, to, lines, 0, 0, t->n, 0, dir < 0, &hk, hc);
+  if (hk < 0) return 0;
+  *hr = ropeIndexOf(&t->rows[hk]);
+  return 1;
+}
+
+/* Depth just before (row,col). */
+int editorDepthAt(int row, int col) {
+  int k, hk, hc;
+  rnode *n = ropeFind(row, &k);
+  editorDepthStep(SIZE_MAX);
+  return depthScanChunk(n, ropeDepthBefore(n), -DEPTH_NONE, 0, 0, 0, k, col, 0, &hk, &hc);
+}
+
+/* Move to the bracket matching the one under the cursor. */
+void editorMatchBracket() {
+  int r, c, d;
+  erow *row = E.cy < E.numrows ? editorRowAt(E.cy) : NULL;
+  if (!row || E.cx >= row->size || !bracketAt(row->chars, E.cx)) { editorFail("Not on a bracket"); return; }
+  d = editorDepthAt(E.cy, E.cx);
+  if (depthOf(row->chars[E.cx]) > 0) { /* The first spot back down at the depth before it */
+    if (!editorDepthFind(E.cy, E.cx, d, 0, 1, &r, &c)) { editorFail("No match"); return; }
+  } else { /* The bracket after the last spot at or below the depth after it */
+    if (editorDepthFind(E.cy, E.cx, d - 1, 0, -1, &r, &c)) editorDepthFind(r, c, DEPTH_NONE / 2, 0, 1, &r, &c);
+    else if (d - 1 < 0 || !editorDepthFind(0, -1, DEPTH_NONE / 2, 0, 1, &r, &c)) { editorFail("No match"); return; }
+  }
+  E.cy = r; E.cx = c;
+}
+
+/* Move to the next or previous block at the cursor line's level: a line,
+ * together with the lines up to where a bracket it leaves open closes. */
+void editorBlockMove(int dir) {
+  int r = E.cy, c, d;
+  if (E.cy >= E.numrows) return;
+  d = editorDepthAt(E.cy, 0);
+  if (dir > 0) { if (editorDepthFind(E.cy, -1, d, 1, 1, &r, &c) && r + 1 < E.numrows) r++; else r = E.numrows - 1; }
+  else if (E.cy > 0) r = editorDepthFind(E.cy - 1, 0, d, 1, -1, &r, &c) ? r + 1 : 0;
+  E.cy = r; E.cx = 0;
+}
+
 /* --- Editor logic --- */
 
 void editorInsertNewline() {
+  if (editorReadOnly()) return;
   if (E.cx == 0) {
     editorInsertRow(E.cy, "", 0);
   } else {
-    erow *row = &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
+    row = editorRowAt(E.cy);
+    undoRecord(UNDO_SPLICE, E.cy, E.cx, row->chars + E.cx, row->size - E.cx, NULL, 0);
     row->size = E.cx;
-    row->chars[row->size] = '\0';
+    if (row->cap) { editorRowReserve(row, row->size + 1); row->chars[row->size] = '\0'; }
+    editorUpdateRow(row);
   }
   E.cy++;
   E.cx = 0;
 }
 
 void editorInsertChar(int c) {
+  if (editorReadOnly()) return;
   if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
   E.cx++;
 }
 
+/* Insert s[0..len) at the cursor in one go; '\r', '\n' and "\r\n" break lines. */
+void editorInsertText(const char *s, size_t len) {
+  if (editorReadOnly()) return;
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  erow *row = editorRowAt(E.cy);
+  size_t taillen = row->size - E.cx, i, start = 0;
+  char *tail = malloc(taillen + 1);
+  memcpy(tail, row->chars + E.cx, taillen);
+  if (taillen) editorRowDelBytes(row, E.cx, taillen);
+  for (i = 0; i <= len; i++) {
+    if (i < len && s[i] != '\r' && s[i] != '\n') continue;
+    if (i > start) editorRowAppendString(editorRowAt(E.cy), (char *)s + start, i - start);
+    E.cx = editorRowAt(E.cy)->size;
+    if (i == len) break;
+    if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') i++;
+    editorInsertRow(++E.cy, "", 0);
+    start = i + 1;
+  }
+  if (taillen) editorRowAppendString(editorRowAt(E.cy), tail, taillen);
+  free(tail);
+}
+
+/* Collect a bracketed paste up to its end marker and insert it as a whole,
+ * rather than key by key. */
+void editorPaste() {
+  static const char end[] = "\x1b[201~";
+  char *buf = NULL;
+  size_t cap = 0, len = 0;
+  while (len < 6 || memcmp(buf + len - 6, end, 6) != 0) {
+    if (IN.w == IN.r && !editorInputFill(1000)) break; /* The marker never came */
+    bufGrow(&buf, &cap, len + 1);
+    buf[len++] = inputAt(0);
+    IN.r++;
+  }
+  if (len >= 6 && memcmp(buf + len - 6, end, 6) == 0) len -= 6;
+  if (len) editorInsertText(buf, len);
+  free(buf);
+}
+
+/* Apply one edit to every row of the block between the mark and the
+ * cursor, in a single pass that undoes as one step: 'i' inserts s at the
+ * block's left column (rows too short for it are left alone), 'a' appends
+ * s to each row and 'd' deletes the block's columns. */
+void editorBlockEdit(int op, const char *s) {
+  if (editorReadOnly()) return;
+  if (E.markrow < 0) { editorFail("No mark; set one with Ctrl+B"); return; }
+  int r0 = E.markrow < E.cy ? E.markrow : E.cy, r1 = E.markrow < E.cy ? E.cy : E.markrow;
+  int c0 = E.markcol < E.cx ? E.markcol : E.cx, c1 = E.markcol < E.cx ? E.cx : E.markcol;
+  int len = s ? strlen(s) : 0, i, n = 0;
+  editorIndexTo(r1 + 1);
+  if (r1 >= E.numrows) r1 = E.numrows - 1;
+  undoBreak();
+  for (i = r0; i <= r1; i++) {
+    erow *row = editorRowAt(i);
+    int from = editorRowSnap(row, c0 < row->size ? c0 : row->size);
+    if (op == 'a') editorRowSplice(row, i, row->size, 0, s, len);
+    else if (op == 'i' && c0 <= row->size) editorRowSplice(row, i, from, 0, s, len);
+    else if (op == 'd' && c0 < row->size) {
+      int to = c1 < row->size ? c1 : row->size;
+      if (to < row->size) to = editorRowSnap(row, to);
+      if (to > from) editorRowSplice(row, i, from, to - from, NULL, 0);
+      else continue;
+    } else continue;
+    n++;
+  }
+  undoBreak();
+  if (E.cy >= r0 && E.cy <= r1 && op != 'a') E.cx = op == 'i' && E.cx >= c0 ? E.cx + len : c0;
+  if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size) E.cx = editorRowAt(E.cy)->size;
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "Edited %d of %d rows", n, r1 - r0 + 1);
+}
+
 void editorDelChar() {
+  if (editorReadOnly()) return;
   if (E.cy == E.numrows) return;
   if (E.cx == 0 && E.cy == 0) return;
   if (E.cx > 0) {
-    editorRowDelBytes(&E.row[E.cy], E.cx - 1, 1);
-    E.cx--;
+    erow *row = editorRowAt(E.cy);
+    int at = editorRowStep(row, E.cx, -1);
+    editorRowDelBytes(row, at, E.cx - at);
+    E.cx = at;
   } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], E.row[E.cy].chars, E.row[E.cy].size);
+    erow *prev = editorRowAt(E.cy - 1), *row = editorRowAt(E.cy);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
     editorDelRow(E.cy);
     E.cy--;
   }
 }
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0, j;
-  for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n'; p++;
-  }
-  return buf;
-}
-
 /* --- File I/O --- */
 
+/* Size and throughput of an open, shown until the next key or for
+ * Q_MSG_SECS. A mapped file is rated on the bytes scanned for the first
+ * screen, as the rest is counted while idle. */
+void editorLoadReport(const char *how, size_t size, size_t done, double t0) {
+  double secs = editorNow() - t0;
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "%s %.1f MB, %.0f MB/s",
+           how, size / 1e6, done / 1e6 / (secs > 1e-9 ? secs : 1e-9));
+  E.msgtime = editorNow() + Q_MSG_SECS;
+}
+
 void editorOpen(char *filename) {
   free(E.filename);
   E.filename = strdup(filename);
-  FILE *fp = fopen(filename, "r");
-  if (!fp) return;
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return;
+  struct stat st;
+  int reg = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (reg && (E.backing = backingFind(&st)) != -1) { /* Already open in another buffer */
+    struct backing *b = &BK[E.backing];
+    close(fd);
+    b->refs++;
+    if (b->fd != -1) {
+      E.map = b->buf; E.mapfd = b->fd; E.mapsize = b->len; E.mapscan = 0; E.mapck = 0;
+      editorIndexTo(E.screenrows + 1);
+    } else {
+      E.loadbuf = b->buf;
+      editorScanLines(ropeLast(), b->buf, b->len, INT_MAX);
+    }
+#ifdef Q_STATS
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Sharing %.1f MB with another buffer", b->len / 1e6);
+#endif
+    E.fpos = b->len; E.fpart = b->len && b->buf[b->len - 1] != '\n';
+    E.dirty = 0;
+    return;
+  }
+  if (reg && st.st_size >= Q_MMAP_MIN) {
+    /* Big file: map it and index only what the first screen needs; the rest
+     * is split into rows while idle. Untouched rows stay views into the map. */
+    double t0 = editorNow();
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      E.mapfd = fd;
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      E.map = map;
+      E.mapsize = st.st_size;
+      E.mapscan = 0; E.mapck = 0;
+      E.backing = backingAdd(&st, map, st.st_size, fd);
+      backingIndexLoad(&BK[E.backing]);
+      editorIndexTo(E.screenrows + 1);
+      editorLoadReport("Mapped", st.st_size, E.mapscan, t0);
+      E.fpos = st.st_size; E.fpart = map[st.st_size - 1] != '\n';
+      E.dirty = 0;
+      return;
+    }
+  }
+  /* Bulk load: read everything into one block, then split it in one pass */
+  double t0 = editorNow();
+  size_t cap = reg ? (size_t)st.st_size + 1 : 1 << 16, len = 0;
+  char *buf = malloc(cap);
+  ssize_t r;
+  while ((r = read(fd, buf + len, cap - len)) > 0 || (r == -1 && errno == EINTR)) {
+    if (r > 0 && (len += r) == cap) buf = realloc(buf, cap *= 2);
+  }
+  close(fd);
+  buf[len] = '\0'; /* There is always slack; keeps the byte after the last row defined */
+  E.loadbuf = buf;
+  if (reg) E.backing = backingAdd(&st, buf, len, -1);
+  editorScanLines(ropeLast(), buf, len, INT_MAX);
+  E.fpos = len; E.fpart = len && buf[len - 1] != '\n';
+  editorLoadReport("Loaded", len, len, t0);
   E.dirty = 0;
 }
 
+/* Row pieces queued for the temp file. Adjacent pieces that are contiguous
+ * in memory (unmodified views and the newlines between them) are merged,
+ * and long merged runs inside the mapping are copied by the kernel. */
+struct saveOut {
+  int fd, mapfd, n;
+  char *map;
+  size_t mapsize;
+  struct iovec iov[Q_SAVE_IOV];
+};
+
+int saveWriteAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) { if (errno == EINTR) continue; return -1; }
+    while (n > 0 && (size_t)w >= iov->iov_len) { w -= iov->iov_len; iov++; n--; }
+    if (n > 0) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= w; }
+  }
+  return 0;
+}
+
+/* Copy map[off..off+len) to the output without passing it through user space. */
+int saveCopyMapped(struct saveOut *o, size_t off, size_t len) {
+  loff_t in = off;
+  while (len > 0) {
+    ssize_t c = copy_file_range(o->mapfd, &in, o->fd, NULL, len, 0);
+    if (c <= 0) { /* Unsupported here (e.g. across filesystems): write from the mapping */
+      struct iovec v = {o->map + in, len};
+      return saveWriteAll(o->fd, &v, 1);
+    }
+    len -= c;
+  }
+  return 0;
+}
+
+int saveFlush(struct saveOut *o) {
+  int i, start = 0;
+  for (i = 0; i < o->n; i++) {
+    char *b = o->iov[i].iov_base;
+    size_t l = o->iov[i].iov_len;
+    if (l < Q_COPY_MIN || !o->map || b < o->map || b + l > o->map + o->mapsize) continue;
+    if (saveWriteAll(o->fd, o->iov + start, i - start) == -1) return -1;
+    if (saveCopyMapped(o, b - o->map, l) == -1) return -1;
+    start = i + 1;
+  }
+  if (saveWriteAll(o->fd, o->iov + start, o->n - start) == -1) return -1;
+  o->n = 0;
+  return 0;
+}
+
+int savePush(struct saveOut *o, const char *p, size_t len) {
+  struct iovec *last = o->n ? &o->iov[o->n - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == p) { last->iov_len += len; return 0; }
+  if (o->n == Q_SAVE_IOV && saveFlush(o) == -1) return -1;
+  o->iov[o->n].iov_base = (char *)p;
+  o->iov[o->n++].iov_len = len;
+  return 0;
+}
+
+/* Saves run on a thread from a snapshot of the rows, so typing goes on
+ * while the file is written. The snapshot is a list of text pieces taken
+ * on the main thread; whatever text it points at stays frozen until the
+ * save is done: changed rows get a fresh copy first (editorRowShared)
+ * and freed rows are only released afterwards. */
+struct savePiece { char *p; unsigned len, nl; }; /* nl: a '\n' goes out after p[0..len) */
+
+struct saveJob {
+  struct savePiece *pieces;
+  size_t npieces, total;
+  char *path, *tmp;
+  mode_t mode;
+  uid_t uid; gid_t gid;          /* the file's owner, kept if we may */
+  int inplace;                   /* rewrite the file itself, not a temp file renamed over it */
+  unsigned gen;                  /* E.gen when the snapshot was taken */
+  off_t journal;                 /* journal offset of the snapshot */
+  size_t written;                /* shared, accessed atomically */
+  int done, ok;                  /* shared, accessed atomically */
+  struct { char *p; int cap; } *defer;
+  int ndefer, defercap;
+  struct saveOut out;
+  pthread_t tid;
+};
+
+void editorSaveDefer(char *p, int cap) {
+  struct saveJob *j = E.save;
+  if (j->ndefer == j->defercap) {
+    j->defercap = j->defercap ? j->defercap * 2 : 256;
+    j->defer = realloc(j->defer, sizeof(*j->defer) * j->defercap);
+  }
+  j->defer[j->ndefer].p = p;
+  j->defer[j->ndefer++].cap = cap;
+}
+
+/* The directory holding 'path' (malloc'd). */
+char *pathDir(const char *path) {
+  char *slash = strrchr(path, '/');
+  return !slash ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+}
+
+/* Write to a temp file beside the target, fsync it and rename it over the
+ * target, so a crash mid-save leaves the old file intact. The old inode
+ * lives on under the mapping, so mapped rows stay valid. A hard-linked
+ * file, or one in a directory we can't write, is rewritten in place. */
+
+void *saveThreadMain(void *arg) {
+  struct saveJob *j = arg;
+  struct saveOut *o = &j->out;
+  size_t i, done = 0;
+  int ok = 0;
+  o->fd = j->inplace ? open(j->path, O_WRONLY) : mkstemp(j->tmp);
+  if (o->fd != -1) {
+    if (!j->inplace && j->uid != (uid_t)-1) fchown(o->fd, j->uid, j->gid); /* Best effort: only root can give a file away */
+    ok = j->inplace || fchmod(o->fd, j->mode) == 0;
+    for (i = 0; ok && i < j->npieces; i++) {
+      struct savePiece *p = &j->pieces[i];
+      ok = savePush(o, p->p, p->len) == 0 && (!p->nl || savePush(o, "\n", 1) == 0);
+      done += p->len + p->nl;
+      if ((i & 1023) == 0) __atomic_store_n(&j->written, done, __ATOMIC_RELAXED);
+    }
+    ok = ok && saveFlush(o) == 0 && (!j->inplace || ftruncate(o->fd, j->total) == 0) && fsync(o->fd) == 0;
+    if (close(o->fd) == -1) ok = 0;
+    if (!j->inplace) {
+      if (ok) ok = rename(j->tmp, j->path) == 0;
+      if (!ok) unlink(j->tmp);
+    }
+  }
+  if (ok && !j->inplace) { /* Make the rename itself durable */
+    char *dirname = pathDir(j->path);
+    int dir = open(dirname, O_RDONLY);
+    if (dir != -1) { fsync(dir); close(dir); }
+    free(dirname);
+  }
+  j->ok = ok;
+  __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Reap the save thread (waiting for it if 'wait') and report the result. */
+int editorSaveFinish(int wait) {
+  struct saveJob *j = E.save;
+  int i;
+  if (!j || (!wait && !__atomic_load_n(&j->done, __ATOMIC_ACQUIRE))) return 0;
+  pthread_join(j->tid, NULL);
+  E.save = NULL;
+  for (i = 0; i < j->ndefer; i++) arenaFree(j->defer[i].p, j->defer[i].cap);
+  if (j->ok && E.gen == j->gen) E.dirty = 0;
+  if (j->ok) journalRebase(j->path, j->journal);
+  if (j->ok) { /* The file is now the snapshot, usually under a new inode */
+    E.fpos = j->total; E.fpart = 0;
+    if (E.fwd != -1) editorFollowWatch();
+  }
+  if (j->ok) snprintf(E.statusmsg, sizeof(E.statusmsg), "Saved");
+  else editorFail("I/O Error");
+  if (!wait) editorScheduleFrame();
+  free(j->pieces); free(j->defer); free(j->path); free(j->tmp); free(j);
+  return 1;
+}
+
+/* Queue p[0..len) for the save thread, and a '\n' after it if 'nl'.
+ * Runs that are contiguous in memory merge into one piece. */
+void editorSavePiece(struct saveJob *j, size_t *cap, char *p, size_t len, int nl) {
+  struct savePiece *last = j->npieces ? &j->pieces[j->npieces - 1] : NULL;
+  j->total += len + nl;
+  if (last && !last->nl && last->p + last->len == p && last->len + len <= UINT_MAX / 2) {
+    last->len += len; last->nl = nl;
+    return;
+  }
+  while (1) {
+    size_t take = len > UINT_MAX / 2 ? UINT_MAX / 2 : len;
+    if (j->npieces == *cap) {
+      *cap = *cap ? *cap * 2 : 4096;
+      j->pieces = realloc(j->pieces, sizeof(struct savePiece) * *cap);
+    }
+    j->pieces[j->npieces++] = (struct savePiece){p, take, take == len ? nl : 0};
+    if (take == len) return;
+    p += take; len -= take;
+  }
+}
+
+/* Snapshot the rows and hand them to a save thread. */
 void editorSave() {
-  if (E.filename == NULL) return; 
-  int len;
-  char *buf = editorRowsToString(&len);
-  FILE *fp = fopen(E.filename, "w");
-  if (fp) {
-    if (ftruncate(fileno(fp), len) != -1) {
-      if (fwrite(buf, len, 1, fp) == 1) {
-        fclose(fp); free(buf); E.dirty = 0;
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "Saved");
-        return;
+  if (E.filename == NULL || editorReadOnly()) return;
+  editorSaveFinish(1); /* One save at a time */
+  editorMapCheck();
+  struct saveJob *j = calloc(1, sizeof(*j));
+  j->path = realpath(E.filename, NULL); /* Replace a symlink's target, not the link */
+  if (!j->path) j->path = strdup(E.filename);
+  j->tmp = malloc(strlen(j->path) + 8);
+  sprintf(j->tmp, "%s.XXXXXX", j->path);
+  struct stat st;
+  j->uid = (uid_t)-1;
+  if (stat(j->path, &st) == 0) {
+    char *dirname = pathDir(j->path);
+    j->mode = st.st_mode & 07777;
+    j->uid = st.st_uid; j->gid = st.st_gid;
+    /* A rename would split hard links, and needs a writable directory:
+     * then the file is rewritten where it is, as it used to be */
+    j->inplace = st.st_nlink > 1 || access(dirname, W_OK) == -1;
+    free(dirname);
+    if (j->inplace) backingDetach(&st);
+  }
+  else { j->mode = umask(0); umask(j->mode); j->mode = 0666 & ~j->mode; }
+  editorIndexTo(INT_MAX);
+  size_t cap = 0;
+  rnode *n;
+  int k;
+  for (n = ropeFirst(); n; n = ropeNext(n)) {
+    if (n->lazy) { editorSavePiece(j, &cap, n->lp, n->llen, n->lp[n->llen - 1] != '\n'); continue; }
+    for (k = 0; k < n->n; k++) {
+      erow *row = &n->rows[k];
+      /* A view followed by its own '\n' joins the piece before it if contiguous */
+      int nl = !(E.map && row->chars + row->size == E.map + E.mapsize) && row->chars[row->size] == '\n';
+      editorSavePiece(j, &cap, row->chars, row->size + nl, !nl);
+    }
+  }
+  j->out.map = E.map; j->out.mapsize = E.mapsize; j->out.mapfd = E.mapfd;
+  j->gen = E.gen;
+  j->journal = journalOffset();
+  E.epoch++;
+  E.save = j;
+  if (pthread_create(&j->tid, NULL, saveThreadMain, j) != 0) saveThreadMain(j);
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "Saving...");
+}
+
+/* Show how far the background save has got. */
+void editorSaveProgress() {
+  struct saveJob *j = E.save;
+  char msg[sizeof(E.statusmsg)];
+  snprintf(msg, sizeof(msg), "Saving %d%%", j->total ? (int)(100.0 * __atomic_load_n(&j->written, __ATOMIC_RELAXED) / j->total) : 100);
+  if (strcmp(msg, E.statusmsg) != 0) { strcpy(E.statusmsg, msg); editorScheduleFrame(); }
+}
+
+/* Write the whole buffer to fd (headless output), rows ended as a save ends them. */
+int editorWriteOut(int fd) {
+  struct saveOut o = {.fd = fd, .mapfd = E.mapfd, .map = E.map, .mapsize = E.mapsize};
+  rnode *n;
+  int k;
+  editorIndexTo(INT_MAX);
+  for (n = ropeFirst(); n; n = ropeNext(n)) {
+    if (n->lazy) {
+      if (savePush(&o, n->lp, n->llen) == -1 || (n->lp[n->llen - 1] != '\n' && savePush(&o, "\n", 1) == -1)) return -1;
+      continue;
+    }
+    for (k = 0; k < n->n; k++) {
+      erow *row = &n->rows[k];
+      int nl = !(E.map && row->chars + row->size == E.map + E.mapsize) && row->chars[row->size] == '\n';
+      if (savePush(&o, row->chars, row->size + nl) == -1 || (!nl && savePush(&o, "\n", 1) == -1)) return -1;
+    }
+  }
+  return saveFlush(&o);
+}
+
+/* --- Buffers --- */
+
+/* Each open file is a buffer. The current one lives in E (up to
+ * screenrows), U and J; the others are parked in BUF, and switching swaps
+ * the blocks. A parked buffer has no save in flight and its journal is on disk. */
+struct buffer { struct editorConfig e; struct undoLog u; struct journal j; } *BUF;
+int nbuf, curbuf;
+
+/* Before 'st' is rewritten in place: give every mapping of it a private
+ * copy of its pages, so rows viewing them keep their text, and stop
+ * copy_file_range and later opens from reading the file through it. */
+void backingDetach(struct stat *st) {
+  long page = sysconf(_SC_PAGESIZE);
+  int i, k;
+  for (i = 0; i < nbk; i++) {
+    struct backing *b = &BK[i];
+    if (!b->refs || b->fd == -1 || b->dev != st->st_dev || b->ino != st->st_ino) continue;
+    size_t off;
+    if (mprotect(b->buf, b->len, PROT_READ | PROT_WRITE) == 0) {
+      for (off = 0; off < b->len; off += page) ((volatile char *)b->buf)[off] = b->buf[off];
+      mprotect(b->buf, b->len, PROT_READ);
+    }
+    b->priv = 1;
+    b->mtime.tv_nsec = -1; /* Matches no file now */
+    if (E.backing == i) E.mapfd = -1;
+    for (k = 0; k < nbuf; k++) if (k != curbuf && BUF[k].e.backing == i) BUF[k].e.mapfd = -1;
+  }
+}
+
+#define EBUF_BYTES offsetof(struct editorConfig, screenrows)
+
+/* Empty state for a new current buffer. */
+void editorBufferReset() {
+  size_t limit = U.limit;
+  memset(&E, 0, EBUF_BYTES);
+  E.mapfd = -1; E.backing = -1; E.sbuild = -1; E.scur = -1; E.fwd = -1; E.markrow = -1;
+  memset(&U, 0, sizeof(U));
+  U.limit = limit; U.brk = 1;
+  J = (struct journal){.fd = -1};
+  editorLayout();
+}
+
+void editorBufferStash() {
+  editorSaveFinish(1);
+  if (J.fd != -1) {
+    if (J.len) journalFlush();
+    if (J.unsynced) { fdatasync(J.fd); J.unsynced = 0; }
+  }
+  memcpy(&BUF[curbuf].e, &E, EBUF_BYTES);
+  BUF[curbuf].u = U;
+  BUF[curbuf].j = J;
+}
+
+/* Make buffer n current and draw it from scratch. */
+void editorBufferLoad(int n) {
+  int y;
+  curbuf = n;
+  memcpy(&E, &BUF[n].e, EBUF_BYTES);
+  U = BUF[n].u;
+  J = BUF[n].j;
+  editorLayout(); /* The screen may have been resized meanwhile */
+  for (y = 0; y < E.framerows; y++) editorFrameInvalidate(y);
+  E.shadowoff = E.rowoff;
+  editorScheduleFrame();
+}
+
+void editorBufferSwitch(int n) {
+  if (n < 0 || n >= nbuf) { editorFail("No such buffer"); return; }
+  if (n == curbuf) return;
+  editorBufferStash();
+  editorBufferLoad(n);
+}
+
+/* Open 'file' in a new buffer after the others and switch to it. */
+void editorBufferOpen(char *file) {
+  int y;
+  editorBufferStash();
+  BUF = realloc(BUF, sizeof(*BUF) * (nbuf + 1));
+  curbuf = nbuf++;
+  editorBufferReset();
+  editorOpen(file);
+  if (E.journal) journalOpen(file);
+  for (y = 0; y < E.framerows; y++) editorFrameInvalidate(y);
+  editorScheduleFrame();
+}
+
+void editorFreeRows(rnode *n) {
+  int k;
+  if (!n) return;
+  editorFreeRows(n->l); editorFreeRows(n->r);
+  for (k = 0; k < n->n; k++) {
+    if (n->rows[k].cap) arenaFree(n->rows[k].chars, n->rows[k].cap);
+    editorRenderFree(&n->rows[k]);
+  }
+  free(n);
+}
+
+/* Drop the current buffer and show its neighbour; the last one exits. */
+void editorBufferClose() {
+  if (nbuf == 1) editorExit();
+  editorSaveFinish(1);
+  journalClose();
+  editorFollowStop();
+  free(J.buf); free(J.path); free(U.b);
+  editorFreeRows(E.rope);
+  while (E.nfblk) free(E.fblk[--E.nfblk]);
+  free(E.fblk);
+  if (E.backing == -1) free(E.loadbuf);
+  else backingRelease(E.backing);
+  free(E.filename); free(E.spat); free(E.sidx);
+  memmove(&BUF[curbuf], &BUF[curbuf + 1], sizeof(*BUF) * (nbuf - curbuf - 1));
+  nbuf--;
+  editorBufferLoad(curbuf < nbuf ? curbuf : nbuf - 1);
+}
+
+int editorDirtyBuffers() {
+  int i, n = E.dirty != 0;
+  for (i = 0; i < nbuf; i++) if (i != curbuf && BUF[i].e.dirty) n++;
+  return n;
+}
+
+/* "[1 a.c*] 2 b.c ..." on the status line, the current one bracketed. */
+void editorBufferList() {
+  char *p = E.statusmsg;
+  size_t room = sizeof(E.statusmsg);
+  int i;
+  for (i = 0; i < nbuf; i++) {
+    struct editorConfig *b = i == curbuf ? &E : &BUF[i].e;
+    int w = snprintf(p, room, i == curbuf ? "[%d %s%s] " : "%d %s%s ", i + 1, b->filename ? b->filename : "[N]", b->dirty ? "*" : "");
+    if ((size_t)w >= room) break;
+    p += w; room -= w;
+  }
+}
+
+/* --- Follow --- */
+
+/* A followed file is watched with inotify. When it grows, only the bytes
+ * past E.fpos are read, into a block that the new rows are views into, so
+ * following a huge log costs what is appended and nothing more. */
+#define Q_FOLLOW_EVENTS (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* Note which buffers' files changed; the current one catches up when idle. */
+void editorFollowEvents() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  int i;
+  while ((n = read(E.inofd, buf, sizeof(buf))) > 0) {
+    char *p;
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      int pend = ev->mask & IN_MODIFY ? 1 : 2;
+      for (i = 0; i < nbuf; i++) {
+        struct editorConfig *b = i == curbuf ? &E : &BUF[i].e;
+        if (b->fwd == ev->wd && b->fpend < pend) b->fpend = pend;
       }
     }
-    fclose(fp);
   }
-  free(buf);
-  snprintf(E.statusmsg, sizeof(E.statusmsg), "I/O Error");
+}
+
+void editorFollowStop() {
+  int i;
+  if (E.fwd == -1) return;
+  for (i = 0; i < nbuf; i++) if (i != curbuf && BUF[i].e.fwd == E.fwd) break;
+  if (i == nbuf) inotify_rm_watch(E.inofd, E.fwd); /* No other buffer shares it */
+  E.fwd = -1; E.fpend = 0;
+}
+
+/* Watch the path again, as it may now be another file; 1 if it is. */
+int editorFollowWatch() {
+  int wd = inotify_add_watch(E.inofd, E.filename, Q_FOLLOW_EVENTS);
+  if (wd == -1) { editorFollowStop(); editorFail("Stopped following: file is gone"); return -1; }
+  if (wd == E.fwd) return 0;
+  editorFollowStop();
+  E.fwd = wd;
+  return 1;
+}
+
+void editorFollow() {
+  struct stat st;
+  if (E.fwd != -1) { editorFollowStop(); snprintf(E.statusmsg, sizeof(E.statusmsg), "Stopped following"); return; }
+  if (E.headless) { editorFail("Can't follow without a terminal"); return; }
+  if (!E.filename || stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode)) { editorFail("Can only follow a file"); return; }
+  if (E.inofd == -1 && (E.inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) { editorFail(strerror(errno)); return; }
+  if ((E.fwd = inotify_add_watch(E.inofd, E.filename, Q_FOLLOW_EVENTS)) == -1) { editorFail(strerror(errno)); return; }
+  E.fpend = 1; /* Whatever was appended since the open */
+  snprintf(E.statusmsg, sizeof(E.statusmsg), "Following");
+  E.msgtime = 0;
+}
+
+/* Append what the file gained past E.fpos as rows. The view keeps up with
+ * the end only if the cursor was on the last row (or past it). */
+void editorFollowStep() {
+  struct stat st;
+  int fd, tail = E.numrows - E.cy;
+  if (E.fpend == 2 && editorFollowWatch() == 1) { /* Rotated: a new file to read from the start */
+    E.fpos = 0; E.fpart = 0;
+  }
+  E.fpend = 0;
+  editorMapCheck(); /* A copytruncate: mapped rows past the cut go blank, and reading resumes at it */
+  if (E.fwd == -1 || (fd = open(E.filename, O_RDONLY)) == -1) return;
+  if (fstat(fd, &st) == -1 || st.st_size == E.fpos) { close(fd); return; }
+  if (st.st_size < E.fpos) {
+    E.fpos = 0; E.fpart = 0;
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "File truncated; following from its start");
+  }
+  size_t want = st.st_size - E.fpos, len = 0;
+  if (want > Q_FOLLOW_SLICE) { want = Q_FOLLOW_SLICE; E.fpend = 1; }
+  char *buf = malloc(want + 1);
+  ssize_t r;
+  while (len < want && ((r = pread(fd, buf + len, want - len, E.fpos + len)) > 0 || (r == -1 && errno == EINTR)))
+    if (r > 0) len += r;
+  close(fd);
+  if (!len) { free(buf); return; }
+  buf[len] = '\0'; /* Defines the byte after the last row, as in a load buffer */
+  E.fpos += len;
+  size_t used = 0;
+  if (E.fpart && E.numrows) { /* The last line goes on */
+    char *nl = memchr(buf, '\n', len);
+    size_t add = nl ? (size_t)(nl - buf) : len;
+    used = nl ? add + 1 : len;
+    if (nl && add && buf[add - 1] == '\r') add--;
+    erow *row = editorRowAt(E.numrows - 1);
+    editorRowReserve(row, row->size + add + 1);
+    memcpy(row->chars + row->size, buf, add);
+    row->size += add;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.fpart = buf[len - 1] != '\n';
+  if (used < len) {
+    editorScanLines(ropeLast(), buf + used, len - used, INT_MAX);
+    E.fblk = realloc(E.fblk, sizeof(char *) * (E.nfblk + 1));
+    E.fblk[E.nfblk++] = buf;
+  } else free(buf);
+  E.gen++;
+  if (tail == 0 || tail == 1) { E.cy = E.numrows - tail; E.cx = 0; }
+  editorScheduleFrame();
 }
 
 /* --- Regex & Commands --- */
 
-void editorRegexReplace(char *pattern, char *repl, int global) {
-    regex_t regex;
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) return;
-    int count = 0, i;
-    for(i=0; i<E.numrows; i++) {
-        erow *row = &E.row[i];
-        regmatch_t match;
-        int offset = 0;
-        while(regexec(&regex, row->chars + offset, 1, &match, 0) == 0) {
-            int start = offset + match.rm_so;
-            int end = offset + match.rm_eo;
-            int ld = (strlen(repl)) - (end - start);
-            row->chars = realloc(row->chars, row->size + ld + 1);
-            memmove(row->chars + end + ld, row->chars + end, row->size - end + 1);
-            memcpy(row->chars + start, repl, strlen(repl));
-            row->size += ld;
-            offset = start + strlen(repl);
-            count++; E.dirty++;
-            if (!global) break; 
+/* A compiled pattern: a regex, or (re NULL) a plain string matched with litFind. */
+typedef struct qpat { regex_t *re; char *lit; int litlen; } qpat;
+
+/* Find the first match in s[from..size); sets [*so, *eo) and returns 1. */
+int patExec(const qpat *p, const char *s, int from, int size, int *so, int *eo) {
+    if (!p->re) {
+        int i = litFind(s + from, size - from, p->lit, p->litlen);
+        if (i < 0) return 0;
+        *so = from + i; *eo = *so + p->litlen;
+        return 1;
+    }
+    regmatch_t m;
+    m.rm_so = from; m.rm_eo = size; /* Rows may be views, not NUL-terminated */
+    if (regexec(p->re, s, 1, &m, REG_STARTEND | (from ? REG_NOTBOL : 0)) != 0) return 0;
+    *so = m.rm_so; *eo = m.rm_eo;
+    return 1;
+}
+
+/* The literal text of pat if it has no regex metacharacters other than
+ * backslash-escaped punctuation (malloc'd, length in *len), else NULL. */
+char *patLiteral(const char *pat, int *len) {
+    char *lit = malloc(strlen(pat) + 1);
+    int n = 0;
+    for (; *pat; pat++) {
+        if (*pat == '\\' && pat[1] && ispunct((unsigned char)pat[1])) pat++;
+        else if (strchr(".[]()*+?{}|^$\\", *pat)) { free(lit); return NULL; }
+        lit[n++] = *pat;
+    }
+    lit[n] = 0; *len = n;
+    return lit;
+}
+
+/* Compiled patterns, reused across commands and evicted least recently used.
+ * Patterns without metacharacters, or any pattern when 'literal' is set,
+ * skip regcomp and are matched as plain strings. */
+#define RE_CACHE 8
+struct reCache { char *pat; int literal; regex_t re; qpat q; unsigned used; } RC[RE_CACHE];
+
+qpat *editorPatGet(const char *pat, int literal) {
+    static unsigned tick;
+    int i, lru = 0;
+    for (i = 0; i < RE_CACHE; i++) {
+        if (RC[i].pat && RC[i].literal == literal && strcmp(RC[i].pat, pat) == 0) { RC[i].used = ++tick; return &RC[i].q; }
+        if (RC[lru].pat && (!RC[i].pat || RC[i].used < RC[lru].used)) lru = i;
+    }
+    struct reCache *c = &RC[lru];
+    if (c->pat) { if (c->q.re) regfree(&c->re); free(c->q.lit); free(c->pat); c->pat = NULL; }
+    c->q.re = NULL;
+    if (literal) { c->q.lit = strdup(pat); c->q.litlen = strlen(pat); }
+    else if (!*pat || !(c->q.lit = patLiteral(pat, &c->q.litlen))) {
+        if (regcomp(&c->re, pat, REG_EXTENDED) != 0) return NULL;
+        c->q.re = &c->re;
+    }
+    c->pat = strdup(pat);
+    c->literal = literal;
+    c->used = ++tick;
+    return &c->q;
+}
+
+/* Make *b hold at least n bytes. */
+char *bufGrow(char **b, size_t *cap, size_t n) {
+    if (n > *cap || !*b) {
+        *cap = n > *cap * 2 ? n : *cap * 2;
+        if (*cap < 256) *cap = 256;
+        *b = realloc(*b, *cap);
+    }
+    return *b;
+}
+
+/* Write s[0..size) with its matches replaced into *buf in a single pass,
+ * setting *len; returns the match count. An empty match just after the
+ * previous match is skipped and otherwise steps one byte, so patterns like
+ * "x*" terminate. Touches nothing global, so workers can call it. */
+int replaceInto(const char *s, int size, const qpat *re, const char *repl, int rlen, int all,
+                char **buf, size_t *cap, size_t *len) {
+    int off = 0, copied = 0, prev = -1, count = 0, so, eo;
+    size_t out = 0;
+    while (off <= size) {
+        if (!patExec(re, s, off, size, &so, &eo)) break;
+        if (so == eo && so == prev) { off = so + 1; continue; }
+        char *b = bufGrow(buf, cap, out + (so - copied) + rlen);
+        memcpy(b + out, s + copied, so - copied); out += so - copied;
+        memcpy(b + out, repl, rlen); out += rlen;
+        copied = eo; prev = eo; count++;
+        if (!all) break;
+        off = eo > so ? eo : so + 1;
+    }
+    if (!count) return 0;
+    char *b = bufGrow(buf, cap, out + (size - copied));
+    memcpy(b + out, s + copied, size - copied); out += size - copied;
+    *len = out;
+    return count;
+}
+
+/* Whether a lazy chunk's raw lines could hold a match; only literals are ruled out. */
+int editorLazyMayMatch(rnode *n, const qpat *re) {
+    return !re->lit || n->llen > INT_MAX || litFind(n->lp, n->llen, re->lit, re->litlen) >= 0;
+}
+
+int editorReplaceRow(erow *row, const qpat *re, const char *repl, int rlen, int all) {
+    size_t len;
+    int count = replaceInto(row->chars, row->size, re, repl, rlen, all, &E.scratch, &E.scratchcap, &len);
+    if (count) editorRowSet(row, E.scratch, len);
+    return count;
+}
+
+/* Parallel global replace. Rope chunks are the work units: workers claim
+ * the next unclaimed chunk from a shared counter until none are left, so
+ * fast workers take over the slack of slow ones. Each worker has its own
+ * regex_t (literals are shared read-only) and collects new row texts
+ * privately; the main thread applies them only if nobody pressed Esc, so
+ * a cancelled replace changes nothing. */
+struct replaceJob {
+    rnode **chunks;
+    int nchunks;
+    const char *pattern, *repl;
+    const qpat *pat;
+    int rlen;
+    int next, done, cancel, finished; /* shared, accessed atomically */
+    int wake;                          /* pipe a finishing worker pokes */
+};
+
+struct replaceResult { erow *row; size_t off; int len; };
+
+struct replaceWorker {
+    struct replaceJob *job;
+    pthread_t tid;
+    char *scratch, *text;
+    size_t scratchcap, textcap, textlen;
+    struct replaceResult *res;
+    int nres, rescap, count;
+};
+
+void *replaceWorkerMain(void *arg) {
+    struct replaceWorker *w = arg;
+    struct replaceJob *job = w->job;
+    regex_t re;
+    qpat p = *job->pat;
+    int c, j, ok = !p.re || regcomp(&re, job->pattern, REG_EXTENDED) == 0;
+    if (p.re) p.re = &re;
+    while (ok && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED) &&
+           (c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+        rnode *n = job->chunks[c];
+        for (j = 0; j < n->n; j++) {
+            size_t len;
+            int k = replaceInto(n->rows[j].chars, n->rows[j].size, &p, job->repl, job->rlen, 1,
+                                &w->scratch, &w->scratchcap, &len);
+            if (!k) continue;
+            bufGrow(&w->text, &w->textcap, w->textlen + len);
+            memcpy(w->text + w->textlen, w->scratch, len);
+            if (w->nres == w->rescap) {
+                w->rescap = w->rescap ? w->rescap * 2 : 1024;
+                w->res = realloc(w->res, sizeof(*w->res) * w->rescap);
+            }
+            w->res[w->nres++] = (struct replaceResult){&n->rows[j], w->textlen, len};
+            w->textlen += len;
+            w->count += k;
+        }
+        __atomic_fetch_add(&job->done, 1, __ATOMIC_RELAXED);
+    }
+    if (ok && p.re) regfree(&re);
+    __atomic_fetch_add(&job->finished, 1, __ATOMIC_RELEASE);
+    write(job->wake, "", 1);
+    return NULL;
+}
+
+/* Run a file-wide replace on all cores; returns the count, or -1 if cancelled. */
+int editorParallelReplace(char *pattern, const qpat *pat, char *repl) {
+    struct replaceJob job = {0};
+    int i, cap = 0, nw = sysconf(_SC_NPROCESSORS_ONLN);
+    rnode *n;
+    for (n = ropeFirst(); n; n = ropeNext(n)) {
+        if (n->lazy && !editorLazyMayMatch(n, pat)) continue;
+        if (n->lazy) n = ropeExpand(n);
+        if (job.nchunks == cap) { cap = cap ? cap * 2 : 256; job.chunks = realloc(job.chunks, sizeof(rnode *) * cap); }
+        job.chunks[job.nchunks++] = n;
+    }
+    job.pattern = pattern; job.pat = pat; job.repl = repl; job.rlen = strlen(repl);
+    if (nw > job.nchunks) nw = job.nchunks;
+    if (nw < 1) nw = 1;
+    int wake[2];
+    if (pipe(wake) == -1) { free(job.chunks); return 0; }
+    job.wake = wake[1];
+    struct replaceWorker *w = calloc(nw, sizeof(*w));
+    for (i = 0; i < nw; i++) { w[i].job = &job; pthread_create(&w[i].tid, NULL, replaceWorkerMain, &w[i]); }
+    int in = E.headless ? -1 : STDIN_FILENO, esc = 0;
+    unsigned seen = IN.w; /* Keys typed before the replace don't cancel it */
+    while (__atomic_load_n(&job.finished, __ATOMIC_ACQUIRE) < nw) {
+        struct pollfd pfd[2] = {{wake[0], POLLIN, 0}, {IN.w - IN.r < Q_INBUF ? in : -1, POLLIN, 0}}; /* fd -1 is ignored */
+        char c;
+        if (poll(pfd, 2, 100) > 0 && pfd[0].revents) read(wake[0], &c, 1);
+        if (pfd[1].revents) {
+            if (!editorInputFill(0)) in = -1; /* Input is gone */
+            esc = editorInputEsc(&seen, 0);
+        } else if (seen != IN.w) esc = editorInputEsc(&seen, 1); /* A lone Esc, or a sequence cut short */
+        if (esc) __atomic_store_n(&job.cancel, 1, __ATOMIC_RELAXED);
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Replacing %d%% (Esc cancels)",
+                 job.nchunks ? 100 * __atomic_load_n(&job.done, __ATOMIC_RELAXED) / job.nchunks : 100);
+        if (!E.headless) editorRefreshScreen();
+    }
+    int count = 0;
+    for (i = 0; i < nw; i++) {
+        pthread_join(w[i].tid, NULL);
+        int j;
+        if (!job.cancel)
+            for (j = 0; j < w[i].nres; j++) editorRowSet(w[i].res[j].row, w[i].text + w[i].res[j].off, w[i].res[j].len);
+        count += w[i].count;
+        free(w[i].scratch); free(w[i].text); free(w[i].res);
+    }
+    close(wake[0]); close(wake[1]);
+    free(w); free(job.chunks);
+    return job.cancel ? -1 : count;
+}
+
+/* Replace the first match on the cursor line, every match on it ('all'),
+ * or every match in the file ('global'), optionally on all cores. */
+void editorRegexReplace(char *pattern, char *repl, int all, int global, int parallel, int literal) {
+    if (editorReadOnly()) return;
+    qpat *re = editorPatGet(pattern, literal);
+    if (!re) { editorFail("Bad regex"); return; }
+    int count = 0, rlen = strlen(repl), i;
+    if (global && parallel) {
+        editorIndexTo(INT_MAX);
+        count = editorParallelReplace(pattern, re, repl);
+        if (count < 0) { snprintf(E.statusmsg, sizeof(E.statusmsg), "Replace cancelled"); return; }
+    } else if (global) {
+        editorIndexTo(INT_MAX);
+        rnode *n;
+        for (n = ropeFirst(); n; n = ropeNext(n)) {
+            if (n->lazy && !editorLazyMayMatch(n, re)) continue; /* Stays unsplit */
+            if (n->lazy) n = ropeExpand(n);
+            for (i = 0; i < n->n; i++) count += editorReplaceRow(&n->rows[i], re, repl, rlen, 1);
         }
-        if(!global && count > 0) break; 
+    } else if (E.cy < E.numrows) {
+        count = editorReplaceRow(editorRowAt(E.cy), re, repl, rlen, all);
     }
-    regfree(&regex);
+    E.dirty += count;
+    if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size) E.cx = editorRowAt(E.cy)->size;
     snprintf(E.statusmsg, sizeof(E.statusmsg), "Replaced %d", count);
 }
 
+/* --- Search --- */
+
+/* First match in the row starting at or after 'from'. */
+int editorRowMatch(erow *row, const qpat *re, int from, int *col) {
+    int eo;
+    if (from > row->size) return 0;
+    return patExec(re, row->chars, from, row->size, col, &eo);
+}
+
+/* Last match in the row starting before 'before'. */
+int editorRowMatchBefore(erow *row, const qpat *re, int before, int *col) {
+    int c, from = 0, found = 0;
+    while (from < before && editorRowMatch(row, re, from, &c) && c < before) { *col = c; found = 1; from = c + 1; }
+    return found;
+}
+
+/* Compare positions (r1,c1) and (r2,c2). */
+int posCmp(int r1, int c1, int r2, int c2) { return r1 != r2 ? (r1 < r2 ? -1 : 1) : (c1 > c2) - (c1 < c2); }
+
+/* The raw line at byte *off of lazy chunk n, as a row outside the rope
+ * (what splitting the chunk would make of it); moves *off past it. */
+void lazyLine(rnode *n, size_t *off, erow *row) {
+    char *p = n->lp + *off, *nl = memchr(p, '\n', n->llen - *off);
+    size_t l = nl ? (size_t)(nl - p) : n->llen - *off;
+    *off += l + (nl != NULL);
+    while (l > 0 && p[l - 1] == '\r') l--;
+    row->chars = p; row->size = l;
+}
+
+/* First (dir 1) or last (dir -1) of lines k0..k1 of lazy chunk n holding
+ * a match, its column in *col; -1 if none. The chunk stays unsplit. */
+int editorLazySearch(rnode *n, const qpat *re, int k0, int k1, int dir, int *col) {
+    size_t off;
+    int k, c, hit = -1;
+    erow row;
+    if (!editorLazyMayMatch(n, re)) return -1;
+    for (k = k0, off = lineOffset(n->lp, n->llen, k0); k <= k1; k++) {
+        lazyLine(n, &off, &row);
+        if (dir > 0 ? editorRowMatch(&row, re, 0, &c) : editorRowMatchBefore(&row, re, row.size + 1, &c)) {
+            hit = k; *col = c;
+            if (dir > 0) break;
+        }
+    }
+    return hit;
+}
+
+/* Add one slice of rows to the match index of the last search. */
+void editorSearchIndexStep(const qpat *re) {
+    if (E.sgen != E.gen || E.sbuild < 0) { E.nsidx = 0; E.sbuild = 0; E.sready = 0; E.sgen = E.gen; }
+    int end = E.sbuild + Q_SEARCH_SLICE, c, first = 0;
+    rnode *lz = NULL;
+    size_t off = 0;
+    erow raw, *row;
+    for (; E.sbuild < E.numrows && E.sbuild < end; E.sbuild++) {
+        if (!lz || E.sbuild >= first + lz->lazy) { /* Lazy chunks are read from the mapping */
+            lz = ropeLazyAt(E.sbuild, &first);
+            if (lz && !editorLazyMayMatch(lz, re)) { E.sbuild = first + lz->lazy - 1; lz = NULL; continue; }
+            if (lz) off = lineOffset(lz->lp, lz->llen, E.sbuild - first);
+        }
+        if (lz) { lazyLine(lz, &off, &raw); row = &raw; }
+        else row = editorRowAt(E.sbuild);
+        int from = 0;
+        while (editorRowMatch(row, re, from, &c)) {
+            if (E.nsidx == Q_SEARCH_MAX) { E.sbuild = -2; E.nsidx = 0; return; } /* Too many to be worth it */
+            if (E.nsidx == E.sidxcap) {
+                E.sidxcap = E.sidxcap ? E.sidxcap * 2 : 1024;
+                E.sidx = realloc(E.sidx, sizeof(smatch) * E.sidxcap);
+            }
+            E.sidx[E.nsidx++] = (smatch){E.sbuild, c};
+            from = c + 1;
+        }
+    }
+    if (E.sbuild >= E.numrows && E.mapscan >= E.mapsize) { E.sready = 1; E.sbuild = -1; }
+}
+
+/* Jump to the next (dir 1) or previous (dir -1) match of the last search.
+ * With a complete index that is a step (or a binary search) in sidx;
+ * otherwise rows are scanned outward from the cursor, wrapping at the
+ * ends, and the first hit wins. */
+void editorSearch(int dir) {
+    qpat *re = E.spat ? editorPatGet(E.spat, 0) : NULL;
+    if (!re) { editorFail(E.spat ? "Bad regex" : "No pattern"); return; }
+    if (E.sready && E.sgen == E.gen) {
+        if (E.nsidx == 0) { snprintf(E.statusmsg, sizeof(E.statusmsg), "Not found"); return; }
+        int k = E.scur;
+        if (k >= 0 && k < E.nsidx && E.sidx[k].row == E.cy && E.sidx[k].col == E.cx) k += dir;
+        else { /* First entry after the cursor, or last one before it */
+            int lo = 0, hi = E.nsidx;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2, c = posCmp(E.sidx[mid].row, E.sidx[mid].col, E.cy, E.cx);
+                if (dir > 0 ? c <= 0 : c < 0) lo = mid + 1; else hi = mid;
+            }
+            k = dir > 0 ? lo : lo - 1;
+        }
+        k = (k + E.nsidx) % E.nsidx;
+        E.scur = k; E.cy = E.sidx[k].row; E.cx = E.sidx[k].col;
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Match %d/%d", k + 1, E.nsidx);
+        return;
+    }
+    int i, c, n, k, first;
+    if (dir > 0) {
+        for (i = E.cy, n = 0; ; i++, n++) {
+            if (i >= E.numrows) { editorIndexTo(i + 1); if (i >= E.numrows) i = 0; }
+            if (E.numrows == 0 || (n > E.numrows && E.mapscan >= E.mapsize)) break;
+            rnode *lz = ropeLazyAt(i, &first);
+            if (lz && (E.cy < first || E.cy >= first + lz->lazy)) { /* Split only around a hit */
+                k = editorLazySearch(lz, re, i - first, lz->lazy - 1, 1, &c);
+                if (k >= 0) { E.cy = first + k; E.cx = c; E.statusmsg[0] = 0; return; }
+                n += first + lz->lazy - 1 - i; i = first + lz->lazy - 1;
+                continue;
+            }
+            erow *row = editorRowAt(i);
+            if (editorRowMatch(row, re, (i == E.cy && n == 0) ? E.cx + 1 : 0, &c) &&
+                !(n > 0 && i == E.cy && c > E.cx)) {
+                E.cy = i; E.cx = c; E.statusmsg[0] = 0;
+                return;
+            }
+        }
+    } else {
+        for (i = E.cy, n = 0; E.numrows && n <= E.numrows; i--, n++) {
+            if (i < 0) { editorIndexTo(INT_MAX); i = E.numrows - 1; }
+            if (i >= E.numrows) continue;
+            rnode *lz = ropeLazyAt(i, &first);
+            if (lz && (E.cy < first || E.cy >= first + lz->lazy)) {
+                k = editorLazySearch(lz, re, 0, i - first, -1, &c);
+                if (k >= 0) { E.cy = first + k; E.cx = c; E.statusmsg[0] = 0; return; }
+                n += i - first; i = first;
+                continue;
+            }
+            erow *row = editorRowAt(i);
+            if (editorRowMatchBefore(row, re, (i == E.cy && n == 0) ? E.cx : row->size + 1, &c)) {
+                E.cy = i; E.cx = c; E.statusmsg[0] = 0;
+                return;
+            }
+        }
+    }
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Not found");
+}
+
+/* Start a new search and have the match index rebuilt in the background. */
+void editorFind(char *pat) {
+    free(E.spat);
+    E.spat = strdup(pat);
+    E.nsidx = 0; E.sready = 0; E.scur = -1;
+    E.sbuild = 0; E.sgen = E.gen;
+    editorSearch(1);
+}
+
+/* One step of whatever background work is pending; 0 when there is none. */
+int editorIdle() {
+    editorMapCheck();
+    if (E.msgtime && editorNow() >= E.msgtime) { E.msgtime = 0; E.statusmsg[0] = 0; editorScheduleFrame(); }
+    journalIdle();
+    if (E.save && !editorSaveFinish(0)) editorSaveProgress();
+    if (E.mapscan < E.mapsize) { editorMapScan(Q_SCAN_SLICE); return 1; }
+    if (E.fpend) { editorFollowStep(); return 1; }
+    if (E.rope && E.rope->tstale) { editorDepthStep(Q_DEPTH_SLICE); if (!E.rope->tstale) traceMark("brackets"); return 1; }
+    if (E.spat && E.sbuild != -2 && !(E.sready && E.sgen == E.gen)) {
+        qpat *re = editorPatGet(E.spat, 0);
+        if (!re) { E.sbuild = -2; return 0; }
+        editorSearchIndexStep(re);
+        return 1;
+    }
+    return 0;
+}
+
 void editorExit() {
-    write(STDOUT_FILENO, "\x1b[0m\x1b[2J\x1b[H", 11);
-    disableRawMode(); 
-    exit(0);
+    int i;
+    editorSaveFinish(1);
+    journalClose();
+    for (i = 0; i < nbuf; i++) if (i != curbuf) { J = BUF[i].j; journalClose(); }
+    if (E.headless) exit(E.errors ? 1 : 0);
+    termWrite("\x1b[0m\x1b[2J\x1b[H", 11);
+    exit(0); /* atexit restores the terminal */
+}
+
+void editorMark() {
+    E.markrow = E.cy; E.markcol = E.cx;
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Mark set at %d,%d", E.cy + 1, E.cx + 1);
+}
+
+void editorJumpTo(int at) {
+    editorIndexTo(at + 1);
+    E.cy = at < E.numrows ? at : E.numrows - 1;
+    if (E.cy < 0) E.cy = 0;
+    E.cx = 0;
+}
+
+/* b<offset>: the line holding that byte of the file as opened. */
+void editorJumpOffset(size_t off) {
+    int at = editorLineAtOffset(off);
+    if (at < 0) { editorFail("No file offsets here"); return; }
+    editorJumpTo(at);
+}
+
+/* N%: by lines once they are all counted, by bytes until then. */
+void editorJumpPercent(long pct) {
+    if (pct > 100) pct = 100;
+    if (E.mapscan < E.mapsize) editorJumpOffset(E.mapsize / 100 * pct + E.mapsize % 100 * pct / 100);
+    else editorJumpTo((int)((long long)E.numrows * pct / 100));
 }
 
 void editorProcessCommand(char *cmd) {
-    if (isdigit(cmd[0])) { /* Jump */
-        int l = atoi(cmd);
+    if (isdigit(cmd[0])) { /* Jump to a line, or N% into the file */
+        char *end;
+        long l = strtol(cmd, &end, 10);
+        if (*end == '%') { editorJumpPercent(l); return; }
+        editorIndexTo(l > 0 ? l : INT_MAX);
         E.cy = (l > 0 && l <= E.numrows) ? l - 1 : E.numrows - 1;
         if(E.cy < 0) E.cy = 0;
         return;
     }
-    if (strcmp(cmd, "q") == 0) {
-         if (E.dirty) { snprintf(E.statusmsg, sizeof(E.statusmsg), "Unsaved! (q!)"); return; }
-         editorExit();
+    if (cmd[0] == 'b' && isdigit(cmd[1])) { editorJumpOffset(strtoull(cmd + 1, NULL, 10)); return; }
+    if (strcmp(cmd, "q") == 0) { /* q closes the buffer; the last one quits */
+         editorSaveFinish(1); /* A save still running decides whether it is dirty */
+         if (E.dirty) { editorFail("Unsaved! (q!)"); return; }
+         editorBufferClose(); return;
+    }
+    if (strcmp(cmd, "q!") == 0) { editorBufferClose(); return; }
+    if (cmd[0] == 'e' && cmd[1] == ' ' && cmd[2]) { editorBufferOpen(cmd + 2); return; }
+    if (cmd[0] == 'b' && (!cmd[1] || cmd[1] == ' ')) { /* b lists buffers, b N switches */
+        if (cmd[1]) editorBufferSwitch(atoi(cmd + 1) - 1);
+        if (!E.statusmsg[0] || !cmd[1]) editorBufferList();
+        return;
+    }
+    if (strcmp(cmd, "bn") == 0 || strcmp(cmd, "bp") == 0) {
+        editorBufferSwitch((curbuf + (cmd[1] == 'n' ? 1 : nbuf - 1)) % nbuf);
+        editorBufferList();
+        return;
+    }
+    if (cmd[0] == '/' && cmd[1]) { editorFind(cmd + 1); return; }
+    if (strcmp(cmd, "n") == 0) { editorSearch(1); return; }
+    if (strncmp(cmd, "undomax", 7) == 0 && (!cmd[7] || cmd[7] == ' ')) { /* undomax [MB]: bound the undo log */
+        if (cmd[7]) U.limit = (size_t)(atoi(cmd + 8) > 0 ? atoi(cmd + 8) : 1) << 20;
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Undo log %.1f of %zu MB", U.len / 1048576.0, U.limit >> 20);
+        return;
+    }
+#ifdef Q_STATS
+    if (strcmp(cmd, "stats") == 0) { statShow(); return; }
+#endif
+    if (strncmp(cmd, "fps", 3) == 0 && (!cmd[3] || cmd[3] == ' ')) { /* fps [cap]: set the cap / show frame counts */
+        if (cmd[3]) E.fps = atoi(cmd + 4) > 0 ? atoi(cmd + 4) : 0;
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "fps cap %d: %lu drawn, %lu skipped", E.fps, E.drawn, E.skipped);
+        return;
     }
-    if (strcmp(cmd, "q!") == 0) editorExit();
+    if (strcmp(cmd, "N") == 0) { editorSearch(-1); return; }
+    if (strcmp(cmd, "follow") == 0) { editorFollow(); return; }
+    if (strcmp(cmd, "mark") == 0) { editorMark(); return; }
+    if (strcmp(cmd, "%") == 0) { editorMatchBracket(); return; }
+    if (strcmp(cmd, "}") == 0 || strcmp(cmd, "{") == 0) { editorBlockMove(cmd[0] == '}' ? 1 : -1); return; }
+    if ((cmd[0] == 'i' || cmd[0] == 'a') && cmd[1] == ' ' && cmd[2]) { editorBlockEdit(cmd[0], cmd + 2); return; }
+    if (strcmp(cmd, "d") == 0) { editorBlockEdit('d', NULL); return; }
     if (strcmp(cmd, "w") == 0) editorSave();
-    if (strcmp(cmd, "wq") == 0) { editorSave(); editorExit(); }
-    if (cmd[0] == 'r' && cmd[1] == '/') {
+    if (strcmp(cmd, "wq") == 0) { editorSave(); editorBufferClose(); return; }
+    if ((cmd[0] == 'r' || cmd[0] == 'l') && cmd[1] == '/') { /* l/ takes the pattern as a plain string */
         char *p = cmd + 2, *r = NULL, *f = NULL, *e = strchr(p, '/');
         if(e) { *e = 0; r = e + 1; e = strchr(r, '/'); if(e) { *e = 0; f = e + 1; } }
-        if(p && r) editorRegexReplace(p, r, (f && strchr(f, 'G')));
+        if(p && r) editorRegexReplace(p, r, (f && strchr(f, 'g')), (f && strchr(f, 'G')), (f && strchr(f, 'P')), cmd[0] == 'l');
+    }
+}
+
+/* Headless (-c): run the commands over the file (or stdin) with no
+ * terminal, then print the buffer to stdout unless one of them quit. */
+void editorBatch(char *file, char **cmds, int n) {
+    int i;
+    E.headless = 1;
+    E.screenrows = 24; E.screencols = 80;
+    editorLayout();
+    if (!file) { editorOpen("/dev/stdin"); free(E.filename); E.filename = NULL; }
+    else {
+        if (access(file, F_OK) == 0 && access(file, R_OK) == -1) { E.filename = strdup(file); editorFail(strerror(errno)); }
+        editorOpen(file);
+    }
+    for (i = 0; i < n; i++) {
+        char *cmd = strdup(cmds[i]); /* r/ splits its argument in place */
+        editorMapCheck();
+        editorProcessCommand(cmd);
+        free(cmd);
     }
+    if (editorWriteOut(STDOUT_FILENO) == -1) editorFail(strerror(errno));
+    editorExit();
 }
 
 char *editorPrompt(char *prompt) {
   size_t bufsize = 128; char *buf = malloc(bufsize); size_t buflen = 0;
   buf[0] = '\0';
+  editorFrame(1); /* Show what the keys before the prompt did */
+  E.prompting = 1;
   while(1) {
-      char s[32]; snprintf(s, sizeof(s), "\x1b[%d;1H", E.screenrows + 1);
-      write(STDOUT_FILENO, s, strlen(s));
-      write(STDOUT_FILENO, "\x1b[2K\x1b[7m", 8); /* Clear + Invert */
-      write(STDOUT_FILENO, prompt, strlen(prompt));
-      write(STDOUT_FILENO, buf, buflen);
-      int total = strlen(prompt) + buflen;
-      while (total++ < E.screencols) write(STDOUT_FILENO, " ", 1); /* Fill bar */
-      write(STDOUT_FILENO, "\x1b[m", 3);
-      snprintf(s, sizeof(s), "\x1b[%d;%ldH", E.screenrows + 1, strlen(prompt) + buflen + 1);
-      write(STDOUT_FILENO, s, strlen(s));
+      /* The whole bar goes out in one write; an answer too long for it shows its end */
+      int plen = strlen(prompt), room = E.screencols - plen - 1, total;
+      size_t from = room > 0 && buflen > (size_t)room ? buflen - room : 0;
+      char s[48];
+      abAppend(&OUT, s, snprintf(s, sizeof(s), "\x1b[%d;1H\x1b[2K\x1b[7m", E.screenrows + 1)); /* Clear + Invert */
+      abAppend(&OUT, prompt, plen);
+      abAppend(&OUT, buf + from, buflen - from);
+      for (total = plen + buflen - from; total < E.screencols; total++) abAppend(&OUT, " ", 1); /* Fill bar */
+      abAppend(&OUT, s, snprintf(s, sizeof(s), "\x1b[m\x1b[%d;%dH", E.screenrows + 1, plen + (int)(buflen - from) + 1));
+      termFlush();
 
       int c = editorReadKey();
       if (c == BACKSPACE || c == 127) { if (buflen != 0) buf[--buflen] = '\0'; }
-      else if (c == '\x1b') { free(buf); return NULL; }
-      else if (c == '\r') return buf;
-      else if (!iscntrl(c) && c < 128) { buf[buflen++] = c; buf[buflen] = '\0'; }
+      else if (c == '\x1b') { free(buf); editorFrameInvalidate(E.screenrows); E.prompting = 0; return NULL; }
+      else if (c == '\r') { editorFrameInvalidate(E.screenrows); E.prompting = 0; return buf; }
+      else if (!iscntrl(c) && c < 128) { bufGrow(&buf, &bufsize, buflen + 2); buf[buflen++] = c; buf[buflen] = '\0'; }
   }
 }
 
 /* --- Rendering --- */
 
-struct abuf { char *b; int len; };
-#define ABUF_INIT {NULL, 0}
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new) { memcpy(&new[ab->len], s, len); ab->b = new; ab->len += len; }
+/* Screen lines as composed for this frame and as last sent to the
+ * terminal. Only lines that differ are redrawn, starting at the first
+ * changed cell; a shadow line with len -1 is unknown and always redrawn. */
+typedef struct sline { int len, cap; char *b; } sline;
+
+void editorFrameInit() {
+  int y, n = E.screenrows + 1;
+  if (E.frame && E.framerows == n && E.framecols == E.screencols) return;
+  for (y = 0; y < E.framerows; y++) { free(E.frame[y].b); free(E.shadow[y].b); }
+  free(E.frame); free(E.shadow);
+  E.frame = malloc(sizeof(sline) * n);
+  E.shadow = malloc(sizeof(sline) * n);
+  for (y = 0; y < n; y++) {
+    E.frame[y].b = malloc(E.frame[y].cap = E.screencols + 1); E.frame[y].len = 0;
+    E.shadow[y].b = malloc(E.shadow[y].cap = E.screencols + 1); E.shadow[y].len = -1;
+  }
+  E.framerows = n;
+  E.framecols = E.screencols;
+  bufGrow(&OUT.b, &OUT.cap, (size_t)n * (E.screencols * 2 + 32)); /* Room for a full redraw */
+}
+
+/* Forget what line y shows, e.g. after the prompt has drawn over it. */
+void editorFrameInvalidate(int y) {
+  if (E.shadow && y < E.framerows) E.shadow[y].len = -1;
+}
+
+/* Screen lines the text moved up (+) or down (-) since the last frame. */
+int editorScrollDelta() {
+  if (E.shadowoff > E.numrows) return E.screenrows;
+  return editorVisualRow(E.rowoff) - editorVisualRow(E.shadowoff);
+}
+
+/* Move the whole text area with a scroll region and shift the shadow to
+ * match, so only the lines scrolled into view need drawing. */
+void editorScrollShadow(struct abuf *ab, int d) {
+  int n = E.screenrows, a = d > 0 ? d : -d, y;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", n, a, d > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+  sline *tmp = malloc(sizeof(sline) * a);
+  if (d > 0) {
+    memcpy(tmp, E.shadow, sizeof(sline) * a);
+    memmove(E.shadow, E.shadow + a, sizeof(sline) * (n - a));
+    memcpy(E.shadow + n - a, tmp, sizeof(sline) * a);
+    for (y = n - a; y < n; y++) E.shadow[y].len = 0;
+  } else {
+    memcpy(tmp, E.shadow + n - a, sizeof(sline) * a);
+    memmove(E.shadow + a, E.shadow, sizeof(sline) * (n - a));
+    memcpy(E.shadow, tmp, sizeof(sline) * a);
+    for (y = 0; y < a; y++) E.shadow[y].len = 0;
+  }
+  free(tmp);
+}
+
+/* Send the changed part of line y, then make it the shadow. */
+void editorDrawLine(struct abuf *ab, int y) {
+  sline *nl = &E.frame[y], *ol = &E.shadow[y];
+  if (ol->len == nl->len && !memcmp(ol->b, nl->b, nl->len)) return;
+  int p = 0, end = nl->len;
+  /* Byte counts are columns only if both lines are plain ASCII */
+  int plain = !editorHasSpecial(nl->b, nl->len) && (ol->len < 0 || !editorHasSpecial(ol->b, ol->len));
+  if (ol->len >= 0) {
+    int m = ol->len < nl->len ? ol->len : nl->len;
+    /* Skip the unchanged prefix while bytes are still one column each */
+    while (p < m && ol->b[p] == nl->b[p] && ol->b[p] >= 32 && ol->b[p] < 127) p++;
+    if (plain && ol->len == nl->len) while (end > p && ol->b[end - 1] == nl->b[end - 1]) end--;
+  }
+  char pos[32];
+  abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;%dH", y + 1, p + 1));
+  if (!plain) abAppend(ab, "\x1b[K", 3); /* Where the new text ends isn't known; clear first */
+  if (y == E.screenrows) abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, nl->b + p, end - p);
+  if (y == E.screenrows) abAppend(ab, "\x1b[m", 3);
+  if (plain && nl->len < E.screencols && (ol->len < 0 || nl->len < ol->len)) abAppend(ab, "\x1b[K", 3);
+  sline t = *ol; *ol = *nl; *nl = t;
 }
-void abFree(struct abuf *ab) { free(ab->b); }
 
 void editorRefreshScreen() {
-  struct abuf ab = ABUF_INIT;
-  /* Hide cursor + Go Home + Reset Color */
-  abAppend(&ab, "\x1b[?25l\x1b[H\x1b[0m", 13);
+  STAT_T0(t);
+  struct abuf *ab = &OUT;
+  editorIndexTo(E.rowoff + E.screenrows);
+  editorFrameInit();
+  /* Hide cursor + Reset Color */
+  abAppend(ab, "\x1b[?25l\x1b[0m", 10);
   
-  int width = E.screencols - 1; /* Soft wrap width (minus padding) */
+  editorLayout();
+  int width = E.wrapw; /* Soft wrap width (minus padding) */
   int visual_r = 0, i;
   int cursor_vy = -1, cursor_vx = -1;
 
   for (i = E.rowoff; i < E.numrows; i++) {
-      int len = E.row[i].size;
-      int chunks = (len / width) + 1;
-      if (len == 0) chunks = 1;
+      erow *row = editorRowAt(i);
+      erender *r = editorRowRender(row); /* Plain ASCII rows draw straight from chars */
+      int len = row->size;
+      int chunks = row->h;
       
       if (i == E.cy) {
-          cursor_vy = visual_r + (E.cx / width);
-          cursor_vx = (E.cx % width) + 2; 
+          int col = editorRowCol(row, E.cx);
+          cursor_vy = visual_r + (col / width);
+          cursor_vx = (col % width) + 2; 
       }
 
       int c = 0, chunk_idx;
       for (chunk_idx = 0; chunk_idx < chunks; chunk_idx++) {
           if (visual_r >= E.screenrows) break;
-          abAppend(&ab, " ", 1); /* Left padding */
-          
+          sline *l = &E.frame[visual_r];
+          const char *text = row->chars + c;
           int clen = width;
           if (c + clen > len) clen = len - c;
+          if (r) { text = r->b + r->line[chunk_idx]; clen = r->line[chunk_idx + 1] - r->line[chunk_idx]; }
+          if (clen + 1 > l->cap) l->b = realloc(l->b, l->cap = clen + 1);
+          l->b[0] = ' '; /* Left padding */
           
-          if (clen > 0) abAppend(&ab, &E.row[i].chars[c], clen);
-          abAppend(&ab, "\x1b[K\r\n", 5);
+          if (clen > 0) memcpy(l->b + 1, text, clen);
+          l->len = clen + 1;
           c += clen; visual_r++;
       }
       if (visual_r >= E.screenrows) break;
   }
   
   while (visual_r < E.screenrows) {
-      abAppend(&ab, "~", 1);
-      abAppend(&ab, "\x1b[K\r\n", 5);
+      E.frame[visual_r].b[0] = '~';
+      E.frame[visual_r].len = 1;
       visual_r++;
   }
   
   /* Status Bar */
   char status[80], rstatus[80];
   if (E.statusmsg[0]) snprintf(status, sizeof(status), "%s", E.statusmsg);
-  else snprintf(status, sizeof(status), "%.20s %dL %s", E.filename?E.filename:"[N]", E.numrows, E.dirty?"*":"");
+  else {
+    char bufno[24] = "";
+    if (nbuf > 1) snprintf(bufno, sizeof(bufno), "%d/%d ", curbuf + 1, nbuf);
+    snprintf(status, sizeof(status), "%s%.20s %dL%s %s", bufno, E.filename?E.filename:"[N]", E.numrows, E.mapscan<E.mapsize?"+":"", E.readonly?"RO":E.dirty?"*":"");
+  }
   int len = strlen(status);
   int rlen = snprintf(rstatus, sizeof(rstatus), "%d,%d", E.cy + 1, E.cx + 1);
   if (len > E.screencols) len = E.screencols;
-  abAppend(&ab, "\x1b[7m", 4);
-  abAppend(&ab, status, len);
+  sline *sl = &E.frame[E.screenrows];
+  memcpy(sl->b, status, len);
   while (len < E.screencols) {
-    if (E.screencols - len == rlen) { abAppend(&ab, rstatus, rlen); break; }
-    else { abAppend(&ab, " ", 1); len++; }
+    if (E.screencols - len == rlen) { memcpy(sl->b + len, rstatus, rlen); len += rlen; break; }
+    else sl->b[len++] = ' ';
   }
-  abAppend(&ab, "\x1b[m", 3);
+  sl->len = len;
+
+  int d = editorScrollDelta();
+  if (d != 0 && d < E.screenrows && d > -E.screenrows) editorScrollShadow(ab, d);
+  E.shadowoff = E.rowoff;
+  for (i = 0; i <= E.screenrows; i++) editorDrawLine(ab, i);
   
   if (cursor_vy != -1 && cursor_vy < E.screenrows) {
       char pos[32];
       snprintf(pos, sizeof(pos), "\x1b[%d;%dH", cursor_vy + 1, cursor_vx);
-      abAppend(&ab, pos, strlen(pos));
+      abAppend(ab, pos, strlen(pos));
   }
   
-  abAppend(&ab, "\x1b[?25h", 6);
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  abAppend(ab, "\x1b[?25h", 6);
+  STAT_ADD(ST_RENDER, t);
+  STAT_COUNT(frames, 1);
+  STAT_COUNT(bytes, ab->len);
+  STAT_T0(w);
+  termFlush();
+  STAT_ADD(ST_WRITE, w);
+}
+
+/* Frames are drawn when the input is drained and at most E.fps times a
+ * second; changes made in between fold into the next frame. */
+double editorNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void editorScheduleFrame() {
+  if (E.redraw) E.skipped++;
+  E.redraw = 1;
+}
+
+/* Milliseconds until the pending frame may be drawn; -1 if none is pending. */
+int editorFrameWait() {
+  if (!E.redraw) return -1;
+  if (!E.fps) return 0;
+  double due = E.lastframe + 1.0 / E.fps - editorNow();
+  return due > 0 ? (int)(due * 1000) + 1 : 0;
+}
+
+/* Draw the pending frame if it is due, or right away with 'force'. */
+void editorFrame(int force) {
+  if (!E.redraw || E.prompting || (!force && editorFrameWait() > 0)) return;
+  editorMapCheck();
+  editorScroll();
+  editorRefreshScreen();
+  E.redraw = 0;
+  E.drawn++;
+  E.lastframe = editorNow();
 }
 
 /* --- Input --- */
 
+/* Keep the cursor's screen line inside the view, counting wrapped lines. */
+void editorScroll() {
+  editorLayout();
+  if (E.cy < E.rowoff) E.rowoff = E.cy;
+  int cv = editorVisualRow(E.cy) + (E.cy < E.numrows ? editorRowCol(editorRowAt(E.cy), E.cx) : 0) / E.wrapw;
+  if (cv >= editorVisualRow(E.rowoff) + E.screenrows) {
+    int sub, r = editorRowAtVisual(cv - E.screenrows + 1, &sub);
+    if (sub) r++; /* The top line must start a row */
+    E.rowoff = r < E.cy ? r : E.cy;
+  }
+}
+
+/* First press goes to the top/bottom row on screen, the next ones move a page. */
+void editorPage(int down) {
+  if (E.numrows == 0) return;
+  int sub, top = editorVisualRow(E.rowoff), last = E.rope->vis - 1, v;
+  if (!down) {
+    if (E.cy != E.rowoff) { E.cy = E.rowoff; return; }
+    v = top - E.screenrows;
+    E.cy = editorRowAtVisual(v > 0 ? v : 0, &sub);
+  } else {
+    v = top + E.screenrows - 1;
+    int bottom = editorRowAtVisual(v < last ? v : last, &sub);
+    if (sub && bottom > E.rowoff) bottom--; /* Only partly on screen */
+    if (E.cy != bottom) { E.cy = bottom; return; }
+    v = editorVisualRow(E.cy) + E.screenrows;
+    E.cy = editorRowAtVisual(v < last ? v : last, &sub);
+  }
+}
+
+void editorHandleResize() {
+  E.resized = 0;
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) return;
+  E.screenrows -= 1;
+  editorLayout();
+}
+
+void editorSigWinch(int sig) { (void)sig; E.resized = 1; }
+
+/* A read of a mapping whose file was cut short after the last
+ * editorMapCheck faults. On the main thread that jumps back to the main
+ * loop, which fixes the mapping up and goes on; anywhere else it is fatal. */
+sigjmp_buf busjmp;
+volatile sig_atomic_t busarmed;
+pthread_t mainthread;
+
+void editorSigBus(int sig) {
+  if (!busarmed || !pthread_equal(pthread_self(), mainthread)) { signal(sig, SIG_DFL); return; } /* Faults again, for good */
+  busarmed = 0;
+  siglongjmp(busjmp, 1);
+}
+
 void editorProcessKeypress() {
   int c = editorReadKey();
+  editorMapCheck();
+  if (E.msgtime) { E.msgtime = 0; E.statusmsg[0] = 0; } /* The load report goes with the first key */
+  editorIndexTo(E.cy + E.screenrows + 2); /* Row bounds below must be real, not just indexed-so-far */
+  static int typing;
+  int ins = c < 256 && (!iscntrl(c) || c == '\t'); /* Bytes of UTF-8 included */
+  if (!ins || !typing) undoBreak(); /* A run of typed characters undoes as one step */
+  typing = ins;
   if (c == CTRL_KEY('q')) {
-      if(E.dirty && E.quit_times > 0) { 
+      editorSaveFinish(1);
+      if(editorDirtyBuffers() && E.quit_times > 0) { 
           snprintf(E.statusmsg, sizeof(E.statusmsg), "Unsaved! Press Ctrl+Q again.");
           E.quit_times--; return; 
       }
@@ -426,42 +3571,101 @@ void editorProcessKeypress() {
   }
   E.quit_times = 1;
   if (c == CTRL_KEY('s')) { editorSave(); return; }
+  if (c == CTRL_KEY('b')) { editorMark(); return; }
+  if (c == CTRL_KEY(']')) { editorMatchBracket(); return; }
+  if (c == CTRL_KEY('z') || c == CTRL_KEY('y')) { editorUndo(c == CTRL_KEY('y')); return; }
+  if (c == CTRL_KEY('n') || c == CTRL_KEY('p')) { editorSearch(c == CTRL_KEY('n') ? 1 : -1); return; }
+  if (c == PASTE_START) { editorPaste(); return; }
   if (c == CTRL_KEY('x')) {
       char *cmd = editorPrompt(">");
       if (cmd) { editorProcessCommand(cmd); free(cmd); }
       return;
   }
+  erow *row = (E.cy < E.numrows) ? editorRowAt(E.cy) : NULL;
   switch (c) {
+  case CTRL_KEY('l'): for (c = 0; c < E.framerows; c++) editorFrameInvalidate(c); break;
   case '\r': editorInsertNewline(); break;
   case HOME_KEY: E.cx = 0; break;
-  case END_KEY: if (E.cy < E.numrows) E.cx = E.row[E.cy].size; break;
+  case END_KEY: if (row) E.cx = row->size; break;
   case BACKSPACE: case DEL_KEY: case CTRL_KEY('h'):
-    if (c == DEL_KEY) { if (E.cx < E.row[E.cy].size) { editorRowDelBytes(&E.row[E.cy], E.cx, 1); } }
+    if (c == DEL_KEY) { if (row && E.cx < row->size && !editorReadOnly()) { editorRowDelBytes(row, E.cx, editorRowStep(row, E.cx, 1) - E.cx); } }
     else editorDelChar();
     break;
   case ARROW_UP:    if (E.cy != 0) E.cy--; break;
   case ARROW_DOWN:  if (E.cy < E.numrows - 1) E.cy++; break;
-  case ARROW_LEFT:  if (E.cx != 0) E.cx--; else if (E.cy>0) { E.cy--; E.cx=E.row[E.cy].size; } break;
-  case ARROW_RIGHT: if (E.cx < E.row[E.cy].size) E.cx++; else if (E.cy<E.numrows-1) { E.cy++; E.cx=0; } break;
-  case PAGE_UP: E.cy = E.rowoff; break;
-  case PAGE_DOWN: E.cy = E.rowoff + E.screenrows - 1; if(E.cy > E.numrows) E.cy = E.numrows; break;
+  case ARROW_LEFT:  if (E.cx != 0) E.cx = editorRowStep(row, E.cx, -1); else if (E.cy>0) { E.cy--; E.cx=editorRowAt(E.cy)->size; } break;
+  case ARROW_RIGHT: if (row && E.cx < row->size) E.cx = editorRowStep(row, E.cx, 1); else if (E.cy<E.numrows-1) { E.cy++; E.cx=0; } break;
+  case PAGE_UP: case PAGE_DOWN: editorPage(c == PAGE_DOWN); break;
   default: if (!iscntrl(c) || c == '\t') editorInsertChar(c); break;
   }
-  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  if (E.cy < E.numrows) { /* Keep the cursor on a character of its row */
+    row = editorRowAt(E.cy);
+    E.cx = editorRowSnap(row, E.cx > row->size ? row->size : E.cx);
+  }
 }
 
-int main(int argc, char *argv[]) {
-  enableRawMode();
-  E.cx = 0; E.cy = 0; E.rowoff = 0; E.numrows = 0; E.row = NULL; E.dirty = 0; E.filename = NULL; 
+void editorInit() {
+  E.frame = E.shadow = NULL; E.framerows = E.framecols = 0; E.shadowoff = 0;
+  E.scratch = NULL; E.scratchcap = 0;
+  E.prompting = 0; E.headless = E.errors = 0; E.journal = 0; E.inofd = -1;
+  E.redraw = 0; E.fps = Q_FPS; E.lastframe = 0; E.drawn = E.skipped = 0;
   E.statusmsg[0] = 0; E.quit_times = 1;
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("ws");
+  U.limit = Q_UNDO_MAX;
+  editorBufferReset();
+  BUF = calloc(1, sizeof(*BUF)); nbuf = 1; curbuf = 0;
+}
+
+#ifndef Q_BENCH /* bench.c brings its own main */
+int main(int argc, char *argv[]) {
+  int i, journal = 0, follow = 0, readonly = 0, ncmds = 0, nfiles = 0;
+  char **cmds = malloc(sizeof(char *) * argc), **files = malloc(sizeof(char *) * argc);
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) journal = 1; /* Keep a crash journal */
+    else if (strcmp(argv[i], "-f") == 0) follow = 1; /* Follow the files as they grow */
+    else if (strcmp(argv[i], "-R") == 0) readonly = 1; /* Read-only */
+    else if (strcmp(argv[i], "--startup-trace") == 0) { T.t0 = editorNow(); atexit(tracePrint); }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) cmds[ncmds++] = argv[++i]; /* Headless command */
+    else files[nfiles++] = argv[i];
+  }
+  editorInit();
+  E.readonly = readonly;
+  traceMark("init");
+  if (ncmds) editorBatch(nfiles ? files[0] : NULL, cmds, ncmds);
+  /* The first buffer is opened (only as far as its first screen, if it is
+   * big), set up and painted before the others are even looked at. */
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) { perror("ws"); exit(1); } /* Not in raw mode yet */
   E.screenrows -= 1; 
-  if (argc >= 2) editorOpen(argv[1]);
+  E.wrapw = 0; editorLayout();
+  E.journal = journal && !readonly;
+  if (nfiles) editorOpen(files[0]);
+  traceMark("open");
+  enableRawMode();
+  signal(SIGWINCH, editorSigWinch);
+  traceMark("terminal");
+  if (nfiles && E.journal) journalOpen(files[0]);
+  if (nfiles && follow) { editorFollow(); editorJumpPercent(100); }
+  editorScheduleFrame();
+  editorFrame(1);
+  traceMark("first paint");
+  for (i = 1; i < nfiles; i++) { /* One buffer per file, the first one shown */
+    editorBufferOpen(files[i]);
+    if (follow) { editorFollow(); editorJumpPercent(100); }
+  }
+  if (nfiles > 1) { editorBufferSwitch(0); traceMark("buffers"); }
+  editorScheduleFrame();
+  mainthread = pthread_self();
+  signal(SIGBUS, editorSigBus);
+  if (sigsetjmp(busjmp, 1)) { /* The key being handled is cut short, the edits so far are kept */
+    if (!editorMapCheck()) { signal(SIGBUS, SIG_DFL); raise(SIGBUS); }
+    E.prompting = 0; OUT.len = 0;
+    editorScheduleFrame();
+  }
+  busarmed = 1;
   while (1) {
-    if (E.cy < E.rowoff) E.rowoff = E.cy;
-    if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
-    editorRefreshScreen();
     editorProcessKeypress();
+    STAT_ADD(ST_PROCESS, S.keyat);
+    editorScheduleFrame();
   }
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,306 @@
+/*
+ * Quecto end-to-end latency benchmark - built by 'make replay', never installed
+ *
+ * Runs the editor binary under a pseudo-terminal, replays keystroke traces
+ * into it and times each event from the write of its bytes to the output it
+ * causes: to the first byte (the key was read, processed and drawn) and to
+ * the last one before the terminal goes quiet (the frame is complete).
+ * Prints one tab-separated line per scenario:
+ *
+ *   scenario  events  p50_us  p90_us  p99_us  max_us  settle_p99_us  bytes/event
+ *
+ * Usage: quecto-replay [-t trace]... editor [MB] [dir]
+ *        (default 1024 MB in $TMPDIR or /tmp)
+ *
+ * A trace file holds one event per line, sent as one write: C escapes
+ * (\r \n \t \e \\ \xHH) are decoded, and blank lines and lines starting
+ * with '#' are skipped. A line that is only \r may run a command, so its
+ * output is waited for as long as a replace may take. Traces are replayed
+ * against the generated file.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_LINE "%08d the quick brown fox jumps over the lazy dog, again and again\n"
+#define REPLAY_ROWS 48
+#define REPLAY_COLS 160
+#define REPLAY_QUIET_MS 20     /* silence that ends an event's output */
+#define REPLAY_SETTLE_MS 500   /* ...and the editor's startup (the background line count redraws) */
+#define REPLAY_WAIT_MS 2000    /* wait for a key's first output byte before counting it as silent */
+#define REPLAY_MAX_MS 300000   /* ...and for a command's: a global replace on a big file */
+
+/* An event is written in one go; events not 'timed' (opening the prompt)
+ * still have their output drained but don't count, nor do silent ones. */
+struct event { char *b; int len, timed, wait; };
+struct trace { const char *name; struct event *e; int n, cap; };
+
+double replayNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void traceAdd(struct trace *t, const char *b, int len, int timed) {
+  if (t->n == t->cap) t->e = realloc(t->e, sizeof(struct event) * (t->cap = t->cap ? t->cap * 2 : 64));
+  struct event *e = &t->e[t->n++];
+  e->b = malloc(len);
+  memcpy(e->b, b, len);
+  e->len = len; e->timed = timed; e->wait = REPLAY_WAIT_MS;
+}
+
+void traceKey(struct trace *t, const char *s, int timed) { traceAdd(t, s, strlen(s), timed); }
+
+/* A command at the Ctrl+X prompt: the prompt opens and the line is typed
+ * at once, and only Enter is timed, since the prompt echoes what is typed
+ * straight away and the command's frame only comes once it has run. */
+void traceCommand(struct trace *t, const char *cmd) {
+  traceKey(t, "\x18", 0);
+  traceKey(t, cmd, 0);
+  traceKey(t, "\r", 1);
+  t->e[t->n - 1].wait = REPLAY_MAX_MS;
+}
+
+void traceFree(struct trace *t) {
+  int i;
+  for (i = 0; i < t->n; i++) free(t->e[i].b);
+  free(t->e);
+}
+
+/* Decode a trace file's escapes in place; returns the length. */
+int traceUnescape(char *s) {
+  char *o = s, *start = s;
+  for (; *s; s++) {
+    if (*s != '\\' || !s[1]) { *o++ = *s; continue; }
+    switch (*++s) {
+    case 'r': *o++ = '\r'; break;
+    case 'n': *o++ = '\n'; break;
+    case 't': *o++ = '\t'; break;
+    case 'e': *o++ = '\x1b'; break;
+    case 'x': { char hex[3] = {0}; int k; for (k = 0; k < 2 && s[1] && strchr("0123456789abcdefABCDEF", s[1]); k++) hex[k] = *++s; *o++ = strtol(hex, NULL, 16); break; }
+    default: *o++ = *s; break;
+    }
+  }
+  return o - start;
+}
+
+int traceLoad(struct trace *t, const char *path) {
+  FILE *f = fopen(path, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  if (!f) { perror(path); return -1; }
+  t->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  while ((len = getline(&line, &cap, f)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    if (!len || line[0] == '#') continue;
+    len = traceUnescape(line);
+    traceAdd(t, line, len, 1);
+    if (len == 1 && line[0] == '\r') t->e[t->n - 1].wait = REPLAY_MAX_MS; /* Likely running a command */
+  }
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+/* Remove the editor's index cache from 'cache' ($XDG_CACHE_HOME/quecto). */
+void replayRemoveCache(const char *cache) {
+  char dir[PATH_MAX], file[PATH_MAX * 2];
+  struct dirent *d;
+  snprintf(dir, sizeof(dir), "%s/quecto", cache);
+  DIR *dp = opendir(dir);
+  while (dp && (d = readdir(dp)))
+    if (d->d_name[0] != '.') { snprintf(file, sizeof(file), "%s/%s", dir, d->d_name); unlink(file); }
+  if (dp) closedir(dp);
+  rmdir(dir);
+  rmdir(cache);
+}
+
+/* Fill 'path' with numbered lines up to 'mb' megabytes. */
+void replayGenerate(const char *path, int mb) {
+  FILE *f = fopen(path, "w");
+  if (!f) { perror(path); exit(1); }
+  size_t total = 0, want = (size_t)mb << 20;
+  int i;
+  for (i = 0; total < want; i++) total += fprintf(f, REPLAY_LINE, i);
+  fclose(f);
+}
+
+/* Start the editor on 'file' behind a pty; returns the master side. */
+int replaySpawn(const char *editor, const char *file, pid_t *pid) {
+  int master, slave;
+  struct winsize ws = {REPLAY_ROWS, REPLAY_COLS, 0, 0};
+  if (openpty(&master, &slave, NULL, NULL, &ws) == -1) { perror("openpty"); exit(1); }
+  if ((*pid = fork()) == -1) { perror("fork"); exit(1); }
+  if (*pid == 0) {
+    close(master);
+    setsid();
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, 0); dup2(slave, 1); dup2(slave, 2);
+    if (slave > 2) close(slave);
+    execl(editor, editor, file, (char *)NULL);
+    perror(editor);
+    _exit(127);
+  }
+  close(slave);
+  return master;
+}
+
+/* Read the editor's output until it has been quiet for 'quiet' ms (or
+ * nothing came within 'first' ms). *t1 is when the first byte came, *t2
+ * the last; returns the bytes read, -1 once the editor is gone. */
+long replayDrain(int fd, int first, int quiet, double *t1, double *t2) {
+  static char buf[1 << 16];
+  struct pollfd p = {fd, POLLIN, 0};
+  long bytes = 0;
+  *t1 = *t2 = 0;
+  for (;;) {
+    int r = poll(&p, 1, bytes ? quiet : first);
+    if (r == -1 && errno == EINTR) continue;
+    if (r <= 0) return bytes;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return bytes ? bytes : -1;
+    *t2 = replayNow();
+    if (!bytes) *t1 = *t2;
+    bytes += n;
+  }
+}
+
+int replayWrite(int fd, const char *b, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, b, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EAGAIN) { struct pollfd p = {fd, POLLOUT, 0}; poll(&p, 1, -1); continue; }
+    if (n <= 0) return -1;
+    b += n; len -= n;
+  }
+  return 0;
+}
+
+int cmpDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double pct(double *v, int n, double q) { return n ? v[(int)(q * (n - 1) + 0.5)] : 0; }
+
+/* Replay a trace against a fresh editor on 'file' and print its line. */
+void replayRun(const char *editor, const char *file, struct trace *t) {
+  pid_t pid;
+  int fd = replaySpawn(editor, file, &pid), i, n = 0;
+  double *lat = malloc(sizeof(double) * (t->n + 1)), *settle = malloc(sizeof(double) * (t->n + 1)), t1, t2;
+  long bytes = 0, got;
+  replayDrain(fd, REPLAY_MAX_MS, REPLAY_SETTLE_MS, &t1, &t2); /* The first frame, and the redraws while it loads */
+  for (i = 0; i < t->n; i++) {
+    struct event *e = &t->e[i];
+    double t0 = replayNow();
+    if (replayWrite(fd, e->b, e->len) == -1) break;
+    if ((got = replayDrain(fd, e->wait, REPLAY_QUIET_MS, &t1, &t2)) < 0) break;
+    if (!e->timed || !got) continue;
+    bytes += got;
+    lat[n] = (t1 - t0) * 1e6;
+    settle[n++] = (t2 - t0) * 1e6;
+  }
+  if (i < t->n) fprintf(stderr, "%s: the editor exited at event %d\n", t->name, i);
+  replayWrite(fd, "\x18q!\r", 4);
+  for (i = 0; i < 50 && waitpid(pid, NULL, WNOHANG) == 0; i++) replayDrain(fd, 100, REPLAY_QUIET_MS, &t1, &t2);
+  if (i == 50) { kill(pid, SIGKILL); waitpid(pid, NULL, 0); }
+  close(fd);
+  qsort(lat, n, sizeof(double), cmpDouble);
+  qsort(settle, n, sizeof(double), cmpDouble);
+  printf("%s\t%d\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\n", t->name, n, pct(lat, n, 0.5), pct(lat, n, 0.9), pct(lat, n, 0.99),
+         n ? lat[n - 1] : 0, pct(settle, n, 0.99), n ? (double)bytes / n : 0);
+  fflush(stdout);
+  free(lat); free(settle);
+}
+
+void scenarioTyping(struct trace *t) {
+  const char *text = "the quick brown fox jumps over the lazy dog ";
+  int i;
+  t->name = "typing";
+  for (i = 0; i < 400; i++) {
+    char c = i % 60 == 59 ? '\r' : text[i % 44];
+    traceAdd(t, &c, 1, 1);
+  }
+  for (i = 0; i < 100; i++) traceKey(t, "\x7f", 1); /* Backspace */
+}
+
+void scenarioPaste(struct trace *t) {
+  char *b = malloc(16 << 10 | 16);
+  int i, len = 0;
+  t->name = "paste";
+  len += sprintf(b, "\x1b[200~");
+  while (len < 16 << 10) len += sprintf(b + len, REPLAY_LINE, len);
+  len += sprintf(b + len, "\x1b[201~");
+  for (i = 0; i < 20; i++) traceAdd(t, b, len, 1);
+  free(b);
+}
+
+void scenarioScroll(struct trace *t) {
+  char cmd[16];
+  int i;
+  t->name = "scroll";
+  for (i = 0; i < 300; i++) traceKey(t, "\x1b[6~", 1); /* Page down */
+  for (i = 0; i < 300; i++) traceKey(t, "\x1b[B", 1);  /* Arrow down */
+  for (i = 0; i < 100; i++) traceKey(t, "\x1b[5~", 1); /* Page up */
+  for (i = 5; i < 100; i += 10) { snprintf(cmd, sizeof(cmd), "%d%%", i); traceCommand(t, cmd); }
+}
+
+void scenarioReplace(struct trace *t) {
+  t->name = "replace";
+  traceCommand(t, "r/fox/cat/G");
+  traceCommand(t, "r/cat/fox/GP");
+}
+
+int main(int argc, char *argv[]) {
+  struct trace loaded[16];
+  int nloaded = 0, i;
+  while (argc > 2 && strcmp(argv[1], "-t") == 0) {
+    if (nloaded == 16) { fprintf(stderr, "too many traces\n"); return 1; }
+    memset(&loaded[nloaded], 0, sizeof(struct trace));
+    if (traceLoad(&loaded[nloaded++], argv[2]) == -1) return 1;
+    argv += 2; argc -= 2;
+  }
+  if (argc < 2) { fprintf(stderr, "usage: %s [-t trace]... editor [MB] [dir]\n", argv[0]); return 1; }
+  const char *editor = argv[1];
+  int mb = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 1024;
+  const char *dir = argc > 3 ? argv[3] : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char big[PATH_MAX], small[PATH_MAX], cache[PATH_MAX];
+  snprintf(big, sizeof(big), "%s/quecto-replay.%d", dir, (int)getpid());
+  snprintf(small, sizeof(small), "%s/quecto-replay-small.%d", dir, (int)getpid());
+  snprintf(cache, sizeof(cache), "%s/quecto-replay-cache.%d", dir, (int)getpid());
+  setenv("XDG_CACHE_HOME", cache, 1); /* Indexes of the generated files go with them */
+  signal(SIGPIPE, SIG_IGN);
+  replayGenerate(small, 1);
+  replayGenerate(big, mb);
+
+  printf("scenario\tevents\tp50_us\tp90_us\tp99_us\tmax_us\tsettle_p99_us\tbytes/event\n");
+  void (*scenarios[])(struct trace *) = {scenarioTyping, scenarioPaste, scenarioScroll, scenarioReplace};
+  for (i = 0; i < 4; i++) {
+    struct trace t = {0};
+    scenarios[i](&t);
+    replayRun(editor, i < 2 ? small : big, &t);
+    traceFree(&t);
+  }
+  for (i = 0; i < nloaded; i++) { replayRun(editor, big, &loaded[i]); traceFree(&loaded[i]); }
+
+  unlink(small);
+  unlink(big);
+  replayRemoveCache(cache);
+  return 0;
+}